@@ -0,0 +1,503 @@
+//=============================================================================
+// Micro-benchmarks for the meltdown primitives. Every figure is in TSC cycles
+// per call, summarized over kRepetitions runs.
+// Build:
+//   make bench
+//
+//=============================================================================
+
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+
+#include "meltdown.h"
+
+const size_t kRepetitions = 1000;
+
+struct Summary {
+  double mean;
+  double stddev;
+  double min;
+  double median;
+};
+
+Summary
+summarize(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double sample : samples) {
+    sum += sample;
+  }
+  double mean = sum / samples.size();
+  double squares = 0;
+  for (double sample : samples) {
+    squares += (sample - mean) * (sample - mean);
+  }
+  return Summary{mean, std::sqrt(squares / samples.size()), samples.front(),
+                 samples[samples.size() / 2]};
+}
+
+inline
+uint64_t
+cycles() {
+  _mm_lfence();
+  uint64_t now = __rdtsc();
+  _mm_lfence();
+  return now;
+}
+
+// Runs body kRepetitions times. body performs calls calls of the primitive
+// under test.
+template <typename Body>
+Summary
+measure(size_t calls, Body body) {
+  std::vector<double> samples;
+  samples.reserve(kRepetitions);
+  for (size_t i = 0; i < kRepetitions; ++i) {
+    uint64_t start = cycles();
+    body();
+    samples.push_back(double(cycles() - start) / calls);
+  }
+  return summarize(samples);
+}
+
+void
+print_header(char const* parameter) {
+  std::cout << std::left << std::setw(24) << "benchmark" << std::right
+            << std::setw(8) << parameter << std::setw(12) << "mean"
+            << std::setw(12) << "stddev" << std::setw(12) << "min"
+            << std::setw(12) << "median" << std::endl;
+}
+
+void
+print_row(char const* name, size_t parameter, Summary const& summary) {
+  std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(8) << parameter
+            << std::setw(12) << summary.mean << std::setw(12) << summary.stddev
+            << std::setw(12) << summary.min << std::setw(12) << summary.median
+            << std::endl;
+}
+
+// flush_from_cache and probe_access_time with the 256 slots spaced
+// 2^exponent bytes apart
+void
+bench_primitives(char * buffer, Timer const& timer) {
+  print_header("stride");
+  for (size_t exponent : {6, 8, 10, 12}) {
+    size_t stride = size_t(1) << exponent;
+    print_row("flush_from_cache", stride, measure(256, [&] {
+      for (size_t j = 0; j < 256; ++j) {
+        flush_from_cache(&buffer[j * stride]);
+      }
+    }));
+    print_row("probe_access_time", stride, measure(256, [&] {
+      for (size_t j = 0; j < 256; ++j) {
+        probe_access_time(&buffer[j * stride], timer);
+      }
+    }));
+  }
+  std::cout << std::endl;
+}
+
+// Overhead, resolution and jitter of an empty measurement with every timer,
+// and the hit and miss latencies it reports. The resolution is the smallest
+// step between two distinct readings; coarsened TSCs show up there.
+void
+bench_timer(Timer timer, char * buffer) {
+  std::vector<double> empty;
+  for (size_t i = 0; i < kTimerCalibrationRuns; ++i) {
+    uint64_t start = timer_start(timer);
+    empty.push_back(timer_stop(timer) - start);
+  }
+  std::sort(empty.begin(), empty.end());
+  double resolution = 0;
+  for (size_t i = 1; i < empty.size(); ++i) {
+    double step = empty[i] - empty[i - 1];
+    if (step > 0 && (resolution == 0 || step < resolution)) {
+      resolution = step;
+    }
+  }
+  calibrate_timer(timer);
+  Calibration calibration = calibrate(buffer, timer);
+  std::cout << std::left << std::setw(24) << timer_name(timer.kind) << std::right
+            << std::fixed << std::setprecision(1) << std::setw(12)
+            << timer.overhead << std::setw(12) << resolution << std::setw(12)
+            << summarize(empty).stddev << std::setw(12)
+            << percentile(calibration.hits, 0.5) << std::setw(12)
+            << percentile(calibration.misses, 0.5) << std::setw(14)
+            << std::setprecision(3) << timer.ticks_per_cycle << std::endl;
+}
+
+void
+bench_timers(char * buffer) {
+  std::cout << std::left << std::setw(24) << "timer" << std::right
+            << std::setw(12) << "overhead" << std::setw(12) << "resolution"
+            << std::setw(12) << "jitter" << std::setw(12) << "hit"
+            << std::setw(12) << "miss" << std::setw(14) << "ticks/cycle"
+            << std::endl;
+  Timer timer;
+  bench_timer(timer, buffer);
+  if (cpu_has_rdtscp()) {
+    timer.kind = TimerKind::kRdtscp;
+    bench_timer(timer, buffer);
+  }
+  try {
+    CountingThread thread;
+    if (calibrate_counter(timer, thread)) {
+      bench_timer(timer, buffer);
+    } else {
+      std::cout << "counting thread too slow" << std::endl;
+    }
+  } catch (std::system_error const& error) {
+    std::cout << error.what() << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// Hit/miss separation of probe regions backed by each kind of page. Page walks
+// add to every probe of a region spread over 256 small pages; the gap is the
+// distance between the slowest 1% of hits and the fastest 1% of misses, the
+// error rate the share of samples the threshold misclassifies.
+void
+bench_pages(Timer const& timer) {
+  std::cout << std::left << std::setw(24) << "pages" << std::right
+            << std::setw(8) << "backed" << std::setw(12) << "hit" << std::setw(12) << "miss"
+            << std::setw(12) << "gap" << std::setw(14) << "error rate"
+            << std::setw(12) << "probe round" << std::endl;
+  for (PageKind pages : {PageKind::kSmall, PageKind::kTransparent, PageKind::kHugetlb}) {
+    ProbeRegion region(pages);
+    std::string name = page_kind_name(pages);
+    if (region.pages() != pages) {
+      name += std::string(" -> ") + page_kind_name(region.pages());
+    }
+    Calibration calibration = calibrate(region.data(), timer);
+    size_t errors = 0, samples = 0;
+    for (size_t t = 0; t < kHistogramBins; ++t) {
+      errors += t > calibration.threshold ? calibration.hits[t] : calibration.misses[t];
+      samples += calibration.hits[t] + calibration.misses[t];
+    }
+    Channel channel;
+    channel.probe = region.data();
+    channel.timer = timer;
+    AccessTimes access_times;
+    Summary round = measure(1, [&] { probe_round(channel, access_times); });
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(8) << (region.huge_page_backed() ? "huge" : "small")
+              << std::setw(12) << percentile(calibration.hits, 0.5)
+              << std::setw(12) << percentile(calibration.misses, 0.5)
+              << std::setw(12)
+              << (long)percentile(calibration.misses, 0.01) -
+                 (long)percentile(calibration.hits, 0.99)
+              << std::setw(14) << std::scientific << std::setprecision(2)
+              << double(errors) / samples
+              << std::setw(12) << std::fixed << std::setprecision(1) << round.median
+              << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// flushing the whole probe region, line by line and batched
+void
+bench_flush(char * buffer) {
+  print_header("stride");
+  print_row("flush: serialized", kPageSize, measure(256, [&] {
+    flush_probe_region_serialized(buffer);
+  }));
+  if (cpu_has_clflushopt()) {
+    print_row("flush: batched", kPageSize, measure(256, [&] {
+      flush_probe_region_batched(buffer);
+    }));
+  }
+  std::cout << std::endl;
+}
+
+// Touches one random slot architecturally and probes the whole region. Every
+// other slot classified as a hit was pulled in by the prefetcher.
+void
+bench_probe_order(Channel channel) {
+  std::mt19937 generator(kProbeOrderSeed);
+  AccessTimes access_times;
+  std::cout << std::left << std::setw(24) << "probe order" << std::right
+            << std::setw(16) << "false hits" << std::setw(16) << "false-hit rate"
+            << std::endl;
+  for (bool permuted : {false, true}) {
+    channel.order = permuted ? permuted_probe_order() : sequential_probe_order();
+    size_t false_hits = 0;
+    for (size_t i = 0; i < kRepetitions; ++i) {
+      size_t hot = generator() % 256;
+      flush_probe_region(channel.probe);
+      *(volatile char *)&channel.probe[hot * kPageSize];
+      probe_round(channel, access_times);
+      for (size_t j = 0; j < 256; ++j) {
+        false_hits += j != hot && access_times[j] <= channel.threshold;
+      }
+    }
+    std::cout << std::left << std::setw(24) << (permuted ? "permuted" : "sequential")
+              << std::right << std::setw(16) << false_hits << std::setw(16)
+              << std::scientific << std::setprecision(2)
+              << double(false_hits) / (255 * kRepetitions) << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+const size_t kKernelRounds = 1024;
+
+// Summarizing a round and voting with every supported kernel, over synthetic
+// rounds of 256 slots and of 16, the byte and the nibble layouts. Rounds a
+// kernel summarizes differently from the scalar one are counted as mismatches.
+void
+bench_kernels() {
+  TimingModel model;
+  model.seed = 1;
+  TimingSimulator simulator(model);
+  uint32_t const threshold = 140;
+  std::cout << std::left << std::setw(24) << "kernel" << std::right
+            << std::setw(8) << "slots" << std::setw(12) << "mean"
+            << std::setw(12) << "min" << std::setw(12) << "median"
+            << std::setw(12) << "mismatches" << std::endl;
+  for (size_t slots : {256, 16}) {
+    std::vector<AccessTimes> rounds(kKernelRounds);
+    for (AccessTimes & access_times : rounds) {
+      simulator.probe_round(simulator.hit() % slots, slots, access_times);
+    }
+    for (Kernel kernel : {Kernel::kScalar, Kernel::kAvx2, Kernel::kAvx512}) {
+      if (!kernel_supported(kernel)) {
+        std::cout << std::left << std::setw(24) << kernel_name(kernel)
+                  << "not supported" << std::endl;
+        continue;
+      }
+      RoundKernel summarize = round_kernel(kernel);
+      size_t mismatches = 0;
+      for (AccessTimes const& access_times : rounds) {
+        RoundSummary expected = summarize_round_scalar(access_times.data(), slots, threshold);
+        RoundSummary summary = summarize(access_times.data(), slots, threshold);
+        mismatches += summary.best != expected.best || summary.fastest != expected.fastest ||
+                      summary.runner_up != expected.runner_up || summary.hits != expected.hits;
+      }
+      VoteTally tally;
+      Summary summary = measure(kKernelRounds, [&] {
+        for (AccessTimes const& access_times : rounds) {
+          RoundSummary round = summarize(access_times.data(), slots, threshold);
+          tally.vote(classify_summary(round, threshold));
+        }
+      });
+      std::cout << std::left << std::setw(24) << kernel_name(kernel) << std::right
+                << std::fixed << std::setprecision(1) << std::setw(8) << slots
+                << std::setw(12) << summary.mean << std::setw(12) << summary.min
+                << std::setw(12) << summary.median << std::setw(12) << mismatches
+                << std::endl;
+    }
+  }
+  std::cout << std::endl;
+}
+
+// one round of sample_byte, phase by phase
+template <typename Suppression>
+void
+bench_phases(Channel & channel, unsigned char const* secret) {
+  std::vector<double> flush, transient, probe, classify;
+  AccessTimes access_times;
+  for (size_t i = 0; i < kRepetitions; ++i) {
+    uint64_t t0 = cycles();
+    flush_probe_region(channel.probe);
+    uint64_t t1 = cycles();
+    Suppression::template transmit<ByteLayout>((size_t)secret, channel.probe, 0,
+                                               channel.stats.transient);
+    uint64_t t2 = cycles();
+    probe_round(channel, access_times);
+    uint64_t t3 = cycles();
+    volatile int slot = classify_round(access_times, channel.threshold);
+    (void)slot;
+    uint64_t t4 = cycles();
+    flush.push_back(t1 - t0);
+    transient.push_back(t2 - t1);
+    probe.push_back(t3 - t2);
+    classify.push_back(t4 - t3);
+  }
+  print_header("stride");
+  print_row("round: flush", kPageSize, summarize(flush));
+  print_row("round: transient load", kPageSize, summarize(transient));
+  print_row("round: probe", kPageSize, summarize(probe));
+  print_row("round: classify", kPageSize, summarize(classify));
+  print_row("leak", kPageSize, measure(1, [&] {
+    leak<Suppression>((size_t)secret, channel.probe, channel.stats.transient);
+  }));
+  std::cout << std::endl;
+}
+
+// Bit and nibble encodings against byte mode at the channel's stride: the
+// cost of one round (flush, transient load, probe and classification), the
+// rounds a byte takes with the early exit and what that makes per byte. The
+// speedup is the byte mode's cycles per byte over the encoding's.
+template <typename Suppression>
+void
+bench_encodings(Channel channel, unsigned char const* secret) {
+  std::cout << std::left << std::setw(24) << "encoding" << std::right
+            << std::setw(8) << "slots" << std::setw(14) << "cycles/round"
+            << std::setw(14) << "rounds/byte" << std::setw(14) << "cycles/byte"
+            << std::setw(10) << "speedup" << std::endl;
+  double byte_cycles = 0;
+  for (size_t symbol_bits : {8, 4, 1}) {
+    channel.layout.symbol_bits = symbol_bits;
+    channel.order = permuted_probe_order(kProbeOrderSeed, channel.layout.slots());
+    channel.stats = ChannelStatistics{};
+    AccessTimes access_times;
+    Summary round = with_layout(channel.layout, [&](auto layout) {
+      typedef decltype(layout) Layout;
+      return measure(1, [&] {
+        leak<Suppression, Layout>((size_t)secret, channel.probe, channel.stats.transient);
+        probe_round<Layout>(channel, access_times);
+        volatile int slot = classify_round<Layout>(access_times, channel.threshold);
+        (void)slot;
+      });
+    });
+    channel.stats = ChannelStatistics{};
+    Summary byte = measure(1, [&] {
+      sample_byte<Suppression>((size_t)secret, channel);
+    });
+    byte_cycles = symbol_bits == 8 ? byte.median : byte_cycles;
+    std::cout << std::left << std::setw(24) << encoding_name(symbol_bits) << std::right
+              << std::setw(8) << channel.layout.slots()
+              << std::setw(14) << std::fixed << std::setprecision(1) << round.median
+              << std::setw(14) << std::setprecision(2)
+              << double(channel.stats.rounds) / channel.stats.bytes
+              << std::setw(14) << std::setprecision(1) << byte.median
+              << std::setw(10) << std::setprecision(2) << byte_cycles / byte.median
+              << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+// Bytes per second and byte error rate of sample_byte on a random canary in
+// every layout with_layout dispatches to, to find the best one for a host. As
+// in the self-test, the transient backends load a canary behind a protection
+// key, so they measure the attack and not architectural loads.
+const size_t kLayoutCanarySize = 256;
+
+void
+bench_layouts(Channel channel) {
+  std::mt19937 generator(kProbeOrderSeed);
+  std::vector<unsigned char> expected(kLayoutCanarySize);
+  ProtectedBuffer canary(kLayoutCanarySize, kNoNode);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    expected[i] = canary[i] = (unsigned char)generator();
+  }
+  if (channel.backend == Backend::kTsx || channel.backend == Backend::kSignal) {
+    canary.protect();
+  }
+  std::cout << std::left << std::setw(24) << "layout" << std::right
+            << std::setw(8) << "stride" << std::setw(8) << "bits"
+            << std::setw(14) << "rounds/byte" << std::setw(14) << "cycles/byte"
+            << std::setw(12) << "bytes/sec" << std::setw(14) << "byte errors"
+            << std::endl;
+  for (size_t symbol_bits : kLayoutSymbolBits) {
+    for (size_t stride_exp : kLayoutStrideExps) {
+      channel.layout.symbol_bits = symbol_bits;
+      channel.layout.stride_exp = stride_exp;
+      channel.order = permuted_probe_order(kProbeOrderSeed, channel.layout.slots());
+      channel.stats = ChannelStatistics{};
+      size_t errors = 0;
+      auto start = std::chrono::steady_clock::now();
+      uint64_t begin = cycles();
+      for (size_t i = 0; i < expected.size(); ++i) {
+        errors += sample_byte((size_t)&canary[i], channel).value != expected[i];
+      }
+      uint64_t end = cycles();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                     start).count();
+      std::cout << std::left << std::setw(24) << "sample_byte" << std::right
+                << std::setw(8) << channel.layout.stride() << std::setw(8) << symbol_bits
+                << std::setw(14) << std::fixed << std::setprecision(2)
+                << double(channel.stats.rounds) / expected.size()
+                << std::setw(14) << std::setprecision(1)
+                << double(end - begin) / expected.size()
+                << std::setw(12) << expected.size() / seconds
+                << std::setw(14) << errors << std::endl;
+    }
+  }
+  std::cout << std::endl;
+}
+
+// sample_byte with a fixed number of rounds and with the early exit
+void
+bench_sampling(Channel channel, unsigned char const* secret) {
+  print_header("samples");
+  for (size_t samples : {1, 4, 16, 64}) {
+    channel.max_samples = samples;
+    channel.margin = samples + 1;
+    print_row("sample_byte: fixed", samples, measure(1, [&] {
+      sample_byte((size_t)secret, channel);
+    }));
+    channel.margin = kDefaultMargin;
+    print_row("sample_byte: early exit", samples, measure(1, [&] {
+      sample_byte((size_t)secret, channel);
+    }));
+  }
+  std::cout << std::endl;
+}
+
+int
+main() {
+  ProbeRegion region;
+  Channel channel;
+  channel.probe = region.data();
+  calibrate_timer(channel.timer);
+  apply_calibration(channel, calibrate(region.data(), channel.timer));
+  // the transient backends load a byte every user-mode load faults on, so
+  // their figures include the cost of suppressing the fault
+  static unsigned char const readable[] = {0x42};
+  ProtectedBuffer faulting(1, kNoNode);
+  faulting[0] = readable[0];
+  faulting.protect();
+
+  bench_timers(region.data());
+  bench_primitives(region.data(), channel.timer);
+  bench_flush(region.data());
+  bench_pages(channel.timer);
+  bench_probe_order(channel);
+  bench_kernels();
+  // the simulated backend runs the same rounds on a timing model, so hosts
+  // without a working attack still measure the sampling code
+  TimingSimulator simulator{TimingModel()};
+  for (Backend backend : {Backend::kTsx, Backend::kSignal, Backend::kBaseline,
+                          Backend::kSimulated}) {
+    if (!backend_supported(backend)) {
+      std::cout << "backend " << backend_name(backend) << " not supported" << std::endl
+                << std::endl;
+      continue;
+    }
+    std::cout << "backend " << backend_name(backend) << std::endl;
+    channel.backend = backend;
+    unsigned char const* secret = backend == Backend::kTsx || backend == Backend::kSignal
+                                ? faulting.data() : readable;
+    if (backend == Backend::kSimulated) {
+      channel.simulator = &simulator;
+      apply_calibration(channel, calibrate(simulator));
+    }
+    switch (backend) {
+      case Backend::kTsx:
+        bench_phases<TsxSuppression>(channel, secret);
+        bench_encodings<TsxSuppression>(channel, secret);
+        break;
+      case Backend::kSignal:
+        bench_phases<SignalSuppression>(channel, secret);
+        bench_encodings<SignalSuppression>(channel, secret);
+        break;
+      case Backend::kBaseline:
+        bench_phases<NoSuppression>(channel, secret);
+        bench_encodings<NoSuppression>(channel, secret);
+        break;
+      case Backend::kSimulated:
+        bench_phases<SimulatedSuppression>(channel, secret);
+        bench_encodings<SimulatedSuppression>(channel, secret);
+        break;
+    }
+    bench_sampling(channel, secret);
+    bench_layouts(channel);
+  }
+  return EXIT_SUCCESS;
+}
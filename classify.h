@@ -0,0 +1,190 @@
+//=============================================================================
+// One-pass summaries of a probe round: the fastest slot, the runner-up time
+// and the number of slots below the hit threshold. A scalar kernel and AVX2
+// and AVX-512 kernels compute the same summary; the fastest one the CPU
+// supports is picked at run time.
+//=============================================================================
+
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <algorithm>
+#include <array>
+#include <stdint.h>
+#include <immintrin.h>
+
+typedef std::array<uint32_t, 256> AccessTimes;
+
+// best is the first slot with the fastest time. Ties count: with two slots
+// equally fast, runner_up equals fastest. The round filter reads the margin to
+// spot rounds with two hits too close to tell apart.
+struct RoundSummary {
+  uint32_t best;
+  uint32_t fastest;
+  uint32_t runner_up;
+  uint32_t hits;
+
+  uint32_t margin() const { return runner_up - fastest; }
+};
+
+// Folds the summary of lane (fastest, runner_up, best) into summary.
+inline
+void
+merge_lane(RoundSummary & summary, uint32_t fastest, uint32_t runner_up, uint32_t best) {
+  uint32_t slower = std::max(summary.fastest, fastest);
+  summary.runner_up = std::min(slower, std::min(summary.runner_up, runner_up));
+  if (fastest < summary.fastest || (fastest == summary.fastest && best < summary.best)) {
+    summary.best = best;
+  }
+  summary.fastest = std::min(summary.fastest, fastest);
+}
+
+inline
+RoundSummary
+summarize_round_scalar(uint32_t const* times, size_t slots, uint32_t threshold) {
+  RoundSummary summary{0, UINT32_MAX, UINT32_MAX, 0};
+  for (size_t j = 0; j < slots; ++j) {
+    summary.hits += times[j] <= threshold;
+    merge_lane(summary, times[j], UINT32_MAX, (uint32_t)j);
+  }
+  return summary;
+}
+
+// Eight lanes each keep their own fastest time, runner-up and best slot; a
+// new time that is not faster than a lane's fastest keeps the lane's best.
+// Unsigned comparisons are built from min and max. Needs slots % 8 == 0.
+__attribute__((target("avx2")))
+inline
+RoundSummary
+summarize_round_avx2(uint32_t const* times, size_t slots, uint32_t threshold) {
+  __m256i const limit = _mm256_set1_epi32((int)threshold);
+  __m256i const step = _mm256_set1_epi32(8);
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i fastest = _mm256_set1_epi32(-1);
+  __m256i runner_up = fastest;
+  __m256i best = _mm256_setzero_si256();
+  uint32_t hits = 0;
+  for (size_t j = 0; j < slots; j += 8) {
+    __m256i time = _mm256_loadu_si256((__m256i const*)(times + j));
+    __m256i below = _mm256_cmpeq_epi32(_mm256_min_epu32(time, limit), time);
+    hits += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+    __m256i not_faster = _mm256_cmpeq_epi32(_mm256_max_epu32(time, fastest), time);
+    best = _mm256_blendv_epi8(index, best, not_faster);
+    runner_up = _mm256_min_epu32(runner_up, _mm256_max_epu32(time, fastest));
+    fastest = _mm256_min_epu32(fastest, time);
+    index = _mm256_add_epi32(index, step);
+  }
+
+  alignas(32) uint32_t lane_fastest[8], lane_runner_up[8], lane_best[8];
+  _mm256_store_si256((__m256i *)lane_fastest, fastest);
+  _mm256_store_si256((__m256i *)lane_runner_up, runner_up);
+  _mm256_store_si256((__m256i *)lane_best, best);
+  RoundSummary summary{0, UINT32_MAX, UINT32_MAX, hits};
+  for (size_t lane = 0; lane < 8; ++lane) {
+    merge_lane(summary, lane_fastest[lane], lane_runner_up[lane], lane_best[lane]);
+  }
+  return summary;
+}
+
+// The same with sixteen lanes and mask registers. Needs slots % 16 == 0. GCC
+// warns about the undefined pass-through operand of its own min and max.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline
+RoundSummary
+summarize_round_avx512(uint32_t const* times, size_t slots, uint32_t threshold) {
+  __m512i const limit = _mm512_set1_epi32((int)threshold);
+  __m512i const step = _mm512_set1_epi32(16);
+  __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512i fastest = _mm512_set1_epi32(-1);
+  __m512i runner_up = fastest;
+  __m512i best = _mm512_setzero_si512();
+  uint32_t hits = 0;
+  for (size_t j = 0; j < slots; j += 16) {
+    __m512i time = _mm512_loadu_si512(times + j);
+    hits += __builtin_popcount(_mm512_cmple_epu32_mask(time, limit));
+    best = _mm512_mask_mov_epi32(best, _mm512_cmplt_epu32_mask(time, fastest), index);
+    runner_up = _mm512_min_epu32(runner_up, _mm512_max_epu32(time, fastest));
+    fastest = _mm512_min_epu32(fastest, time);
+    index = _mm512_add_epi32(index, step);
+  }
+
+  alignas(64) uint32_t lane_fastest[16], lane_runner_up[16], lane_best[16];
+  _mm512_store_si512(lane_fastest, fastest);
+  _mm512_store_si512(lane_runner_up, runner_up);
+  _mm512_store_si512(lane_best, best);
+  RoundSummary summary{0, UINT32_MAX, UINT32_MAX, hits};
+  for (size_t lane = 0; lane < 16; ++lane) {
+    merge_lane(summary, lane_fastest[lane], lane_runner_up[lane], lane_best[lane]);
+  }
+  return summary;
+}
+#pragma GCC diagnostic pop
+
+enum class Kernel {
+  kScalar,
+  kAvx2,
+  kAvx512
+};
+
+typedef RoundSummary (*RoundKernel)(uint32_t const* times, size_t slots, uint32_t threshold);
+
+inline
+char const*
+kernel_name(Kernel kernel) {
+  switch (kernel) {
+    case Kernel::kScalar: return "scalar";
+    case Kernel::kAvx2:   return "avx2";
+    case Kernel::kAvx512: return "avx512";
+  }
+  return "unknown";
+}
+
+inline
+bool
+kernel_supported(Kernel kernel) {
+  switch (kernel) {
+    case Kernel::kScalar: return true;
+    case Kernel::kAvx2:   return __builtin_cpu_supports("avx2");
+    case Kernel::kAvx512: return __builtin_cpu_supports("avx512f");
+  }
+  return false;
+}
+
+inline
+RoundKernel
+round_kernel(Kernel kernel) {
+  switch (kernel) {
+    case Kernel::kScalar: return summarize_round_scalar;
+    case Kernel::kAvx2:   return summarize_round_avx2;
+    case Kernel::kAvx512: return summarize_round_avx512;
+  }
+  return summarize_round_scalar;
+}
+
+inline
+Kernel
+fastest_kernel() {
+  return kernel_supported(Kernel::kAvx512) ? Kernel::kAvx512
+       : kernel_supported(Kernel::kAvx2)   ? Kernel::kAvx2
+       : Kernel::kScalar;
+}
+
+// Summarizes the first slots access times with the fastest kernel. Merging
+// sixteen lanes costs more than AVX-512 saves on a round of 16 slots, so short
+// rounds go through AVX2, and rounds shorter than a vector through the scalar
+// kernel.
+inline
+RoundSummary
+summarize_round(AccessTimes const& access_times, size_t slots, uint32_t threshold) {
+  static RoundKernel const kernel = round_kernel(fastest_kernel());
+  static RoundKernel const short_kernel = round_kernel(
+      kernel_supported(Kernel::kAvx2) ? Kernel::kAvx2 : Kernel::kScalar);
+  RoundKernel summarize = slots >= 64 && slots % 16 == 0 ? kernel
+                        : slots % 8 == 0                 ? short_kernel
+                        : summarize_round_scalar;
+  return summarize(access_times.data(), slots, threshold);
+}
+
+#endif // CLASSIFY_H
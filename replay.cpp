@@ -0,0 +1,421 @@
+//=============================================================================
+// Replays a trace recorded with meltdown --trace through the classification
+// of sample_byte, without touching the hardware. Every combination of the
+// given classifiers, thresholds, margins, sample limits and retry budgets is
+// scored against the canary bytes of the self-test, the combinations in
+// parallel.
+// Build:
+//   make meltdown_replay
+//
+//=============================================================================
+
+#include <vector>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+
+#include "confusion.h"
+#include "meltdown.h"
+
+// The rounds of one symbol, consecutive in the trace.
+struct TracedSymbol {
+  uint64_t first;
+  uint32_t rounds;
+};
+
+struct TracedByte {
+  uint64_t index;
+  uint16_t expected;
+  std::vector<TracedSymbol> symbols;
+};
+
+// Splits the trace into bytes and their symbols. If the ring wrapped, the
+// oldest byte may have lost rounds and is dropped, as are bytes missing a
+// symbol.
+std::vector<TracedByte>
+split_bytes(TraceFile const& trace, size_t symbols) {
+  std::vector<TracedByte> bytes;
+  for (uint64_t i = 0; i < trace.size(); ++i) {
+    TraceRecord const& record = trace[i];
+    if (bytes.empty() || record.byte_index != bytes.back().index) {
+      bytes.push_back(TracedByte{record.byte_index, record.expected, {}});
+    }
+    std::vector<TracedSymbol> & traced = bytes.back().symbols;
+    if (traced.size() != (size_t)record.symbol + 1) {
+      traced.push_back(TracedSymbol{i, 0});
+    }
+    traced.back().rounds++;
+  }
+  if (trace.wrapped() && !bytes.empty()) {
+    bytes.erase(bytes.begin());
+  }
+  bytes.erase(std::remove_if(bytes.begin(), bytes.end(), [&](TracedByte const& byte) {
+    return byte.symbols.size() != symbols;
+  }), bytes.end());
+  return bytes;
+}
+
+// Classifiers see all 256 access times; slots the layout does not use read
+// UINT16_MAX and never win.
+typedef int (*Classifier)(AccessTimes const& access_times, size_t threshold);
+
+struct NamedClassifier {
+  char const* name;
+  Classifier classify;
+  bool thresholded;             // replayed once per threshold, else just once
+};
+
+// Votes for the fastest slot whether or not it is a hit, as the original
+// attack did; ignores the threshold.
+int
+classify_argmin(AccessTimes const& access_times, size_t threshold) {
+  return (int)summarize_round(access_times, 256, UINT32_MAX).best;
+}
+
+// The classifiers a replay can choose from: the one of sample_byte, which
+// votes for the fastest slot only if it is a hit and for kNoHit otherwise,
+// and plain argmin.
+const NamedClassifier kClassifiers[] = {
+  {"threshold", classify_round<>, true},
+  {"argmin",    classify_argmin,  false},
+};
+
+const size_t kClassifierCount = sizeof(kClassifiers) / sizeof(kClassifiers[0]);
+
+// The threshold of a replay that follows the record, classifying and
+// filtering every round with the thresholds it was recorded with.
+const size_t kLiveThreshold = 0;
+
+struct Parameters {
+  size_t classifier;
+  size_t threshold;
+  size_t margin;
+  size_t max_samples;
+  size_t retries;
+};
+
+// A symbol is truncated if the recording stopped sampling it before the
+// replayed parameters would have; its result then rests on fewer rounds than
+// it would get on the host.
+struct ReplayResult {
+  Parameters parameters;
+  size_t bytes;
+  size_t byte_errors;
+  size_t bit_errors;
+  size_t rounds;
+  size_t discarded;
+  size_t truncated;
+
+  double accuracy() const { return 1 - double(byte_errors) / bytes; }
+  double bit_error_rate() const { return double(bit_errors) / (8 * bytes); }
+  double rounds_per_byte() const { return double(rounds) / bytes; }
+  double bits_per_round() const { return symmetric_capacity(1 - accuracy()) / rounds_per_byte(); }
+};
+
+// The loop of sample_byte over the recorded rounds of one symbol, poisoned
+// rounds filtered by the recorded cycles and the replayed threshold. With
+// kLiveThreshold every round is classified and filtered with the thresholds
+// it was recorded with.
+ByteSample
+replay_symbol(TraceFile const& trace, TracedSymbol const& symbol,
+              Parameters const& parameters, RoundFilter & filter, ReplayResult & result) {
+  Classifier classify = kClassifiers[parameters.classifier].classify;
+  VoteTally tally;
+  AccessTimes access_times;
+
+  size_t i = 0, retries = 0;
+  while (i < parameters.max_samples && tally.margin() < parameters.margin) {
+    if (i + retries == symbol.rounds) {
+      result.truncated++;
+      break;
+    }
+    TraceRecord const& record = trace[symbol.first + i + retries];
+    std::copy(record.access_times, record.access_times + 256, access_times.begin());
+    size_t threshold = parameters.threshold;
+    if (threshold == kLiveThreshold) {
+      threshold = record.threshold;
+      filter.slow = record.slow;
+      filter.min_margin = record.min_margin;
+    }
+    RoundSummary summary = summarize_round(access_times, 256, summary_threshold(threshold));
+    if (filter.inspect(summary, record.cycles) != Poison::kNone &&
+        retries < filter.retries) {
+      ++retries;
+      continue;
+    }
+    tally.vote(classify(access_times, threshold));
+    ++i;
+  }
+  result.rounds += i + retries;
+  result.discarded += retries;
+  return tally_result(tally);
+}
+
+unsigned char
+replay_byte(TraceFile const& trace, TracedByte const& byte, Parameters const& parameters,
+            RoundFilter & filter, ReplayResult & result) {
+  unsigned char value = 0;
+  for (size_t s = 0; s < byte.symbols.size(); ++s) {
+    value |= replay_symbol(trace, byte.symbols[s], parameters, filter, result).value <<
+             (s * trace.header().symbol_bits);
+  }
+  return value;
+}
+
+ReplayResult
+replay(TraceFile const& trace, std::vector<TracedByte> const& bytes,
+       Parameters const& parameters) {
+  ReplayResult result{parameters, 0, 0, 0, 0, 0, 0};
+  // the filter of the recording at calibration, learning the round cycles
+  // afresh
+  RoundFilter filter;
+  filter.slow = trace.header().slow;
+  filter.min_margin = trace.header().min_margin;
+  filter.retries = parameters.retries;
+  for (TracedByte const& byte : bytes) {
+    if (byte.expected == kUnknownByte) {
+      continue;
+    }
+    unsigned char value = replay_byte(trace, byte, parameters, filter, result);
+    result.bytes++;
+    result.byte_errors += value != byte.expected;
+    result.bit_errors += __builtin_popcount(value ^ byte.expected);
+  }
+  return result;
+}
+
+// Parses a comma separated list of numbers no less than minimum. Returns an
+// empty list if it is malformed.
+std::vector<size_t>
+parse_list(char const* text, size_t minimum = 1) {
+  std::vector<size_t> values;
+  while (*text) {
+    char * end;
+    size_t value = strtoul(text, &end, 10);
+    if (end == text || value < minimum || (*end && *end != ',')) {
+      return std::vector<size_t>();
+    }
+    values.push_back(value);
+    text = *end ? end + 1 : end;
+  }
+  return values;
+}
+
+// Thresholds tried unless given: the live ones, the calibrated one and a
+// spread between the hit and miss medians.
+const size_t kDefaultThresholdSteps = 8;
+
+std::vector<size_t>
+default_thresholds(TraceHeader const& header) {
+  std::vector<size_t> thresholds{kLiveThreshold, header.threshold};
+  if (header.miss_median > header.hit_median) {
+    for (size_t k = 0; k <= kDefaultThresholdSteps; ++k) {
+      thresholds.push_back(header.hit_median +
+                           (header.miss_median - header.hit_median) * k /
+                           kDefaultThresholdSteps);
+    }
+  }
+  std::sort(thresholds.begin(), thresholds.end());
+  thresholds.erase(std::unique(thresholds.begin(), thresholds.end()), thresholds.end());
+  return thresholds;
+}
+
+int
+main(int argc, char* argv[]) {
+  static const char * usage =
+      "usage: meltdown_replay [options] <trace>\n"
+      "options:\n"
+      "  --classifier LIST   classifiers to replay: 'threshold', the one of the\n"
+      "                      attack, and 'argmin', which votes for the fastest\n"
+      "                      slot even if it is no hit (default: both)\n"
+      "  --threshold LIST    hit thresholds, 0 for the live one of every round,\n"
+      "                      default: 0, the calibrated one and a spread between\n"
+      "                      the recorded hit and miss medians\n"
+      "  --margin LIST       early exit margins (default 1,2,3,4,6,8)\n"
+      "  --max-samples LIST  rounds per byte (default 8,16,32,64)\n"
+      "  --retries LIST      poisoned rounds discarded per symbol, 0 replays\n"
+      "                      without the round filter (default 0,8)\n"
+      "  --jobs N            replay N parameter sets at once (default: all CPUs)\n"
+      "Lists are comma separated. Record with a margin above --max-samples to\n"
+      "keep every round of every byte.\n";
+  static const struct option long_options[] = {
+    {"classifier",  required_argument, nullptr, 'C'},
+    {"threshold",   required_argument, nullptr, 'h'},
+    {"margin",      required_argument, nullptr, 'm'},
+    {"max-samples", required_argument, nullptr, 'n'},
+    {"retries",     required_argument, nullptr, 'y'},
+    {"jobs",        required_argument, nullptr, 'j'},
+    {nullptr,       0,                 nullptr, 0}
+  };
+
+  std::vector<size_t> classifiers;
+  for (size_t c = 0; c < kClassifierCount; ++c) {
+    classifiers.push_back(c);
+  }
+  std::vector<size_t> thresholds;
+  std::vector<size_t> margins{1, 2, 3, 4, 6, 8};
+  std::vector<size_t> max_samples{8, 16, 32, 64};
+  std::vector<size_t> retries{0, kDefaultRetries};
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    std::vector<size_t> * list = nullptr;
+    size_t minimum = 1;
+    switch (option) {
+      case 'C':
+        classifiers.clear();
+        for (char * name = strtok(optarg, ","); name; name = strtok(nullptr, ",")) {
+          size_t c = 0;
+          while (c < kClassifierCount && strcmp(name, kClassifiers[c].name) != 0) {
+            ++c;
+          }
+          if (c == kClassifierCount) {
+            std::cerr << usage;
+            return EXIT_FAILURE;
+          }
+          classifiers.push_back(c);
+        }
+        break;
+      case 'h': list = &thresholds; minimum = 0; break;
+      case 'm': list = &margins; break;
+      case 'n': list = &max_samples; break;
+      case 'y': list = &retries; minimum = 0; break;
+      case 'j': jobs = strtoul(optarg, nullptr, 10); break;
+      default:
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    if (list && (*list = parse_list(optarg, minimum)).empty()) {
+      std::cerr << usage;
+      return EXIT_FAILURE;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 1 || classifiers.empty() || jobs == 0) {
+    std::cerr << usage;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    TraceFile trace(argv[0]);
+    LayoutSpec layout;
+    layout.stride_exp = trace.header().stride_exp;
+    layout.symbol_bits = trace.header().symbol_bits;
+    if (!layout_supported(layout)) {
+      throw std::runtime_error(std::string(argv[0]) + " has an unknown layout");
+    }
+    std::vector<TracedByte> bytes = split_bytes(trace, 8 / layout.symbol_bits);
+    size_t known = std::count_if(bytes.begin(), bytes.end(), [](TracedByte const& byte) {
+      return byte.expected != kUnknownByte;
+    });
+    if (known == 0) {
+      throw std::runtime_error(std::string(argv[0]) + " has no self-test rounds");
+    }
+    if (thresholds.empty()) {
+      thresholds = default_thresholds(trace.header());
+    }
+    if (trace.header().reference_interval &&
+        std::find(thresholds.begin(), thresholds.end(), kLiveThreshold) == thresholds.end()) {
+      std::cerr << "meltdown_replay: the thresholds of " << argv[0] << " followed the drift "
+                << "of the host, fixed ones do not replay the recording; add threshold 0"
+                << std::endl;
+    }
+
+    std::vector<ReplayResult> results;
+    std::vector<size_t> recorded{kLiveThreshold};
+    for (size_t c : classifiers) {
+      for (size_t t : kClassifiers[c].thresholded ? thresholds : recorded) {
+        for (size_t m : margins) {
+          for (size_t n : max_samples) {
+            for (size_t y : retries) {
+              results.push_back(ReplayResult{Parameters{c, t, m, n, y}, 0, 0, 0, 0, 0, 0});
+            }
+          }
+        }
+      }
+    }
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < std::min(jobs, results.size()); ++w) {
+      workers.emplace_back([&] {
+        for (size_t r; (r = next.fetch_add(1)) < results.size();) {
+          results[r] = replay(trace, bytes, results[r].parameters);
+        }
+      });
+    }
+    for (std::thread & worker : workers) {
+      worker.join();
+    }
+
+    // most accurate first, the cheaper one on a tie
+    std::stable_sort(results.begin(), results.end(),
+                     [](ReplayResult const& a, ReplayResult const& b) {
+      return a.bit_errors != b.bit_errors ? a.bit_errors < b.bit_errors : a.rounds < b.rounds;
+    });
+
+    TraceHeader const& header = trace.header();
+    size_t poisoned = 0;
+    for (uint64_t i = 0; i < trace.size(); ++i) {
+      poisoned += trace[i].poison != (uint8_t)Poison::kNone;
+    }
+    std::cout << "rounds:      " << trace.size() << (trace.wrapped() ? " (wrapped)" : "")
+              << ", " << poisoned << " poisoned when recorded" << std::endl
+              << "bytes:       " << known << " of " << bytes.size() << " known" << std::endl
+              << "layout:      " << layout.slots() << " slots, " << layout.stride()
+              << " bytes apart" << std::endl
+              << "threshold:   " << header.threshold << ", ";
+    if (header.reference_interval) {
+      std::cout << "recalibrated every " << header.reference_interval << " rounds";
+    } else {
+      std::cout << "fixed";
+    }
+    std::cout << std::endl
+              << "hit median:  " << header.hit_median << std::endl
+              << "miss median: " << header.miss_median << std::endl
+              << std::endl;
+    std::cout << std::left << std::setw(12) << "classifier" << std::right
+              << std::setw(11) << "threshold" << std::setw(8) << "margin"
+              << std::setw(13) << "max samples" << std::setw(9) << "retries"
+              << std::setw(11) << "accuracy"
+              << std::setw(16) << "bit error rate" << std::setw(13) << "rounds/byte"
+              << std::setw(12) << "bits/round" << std::setw(11) << "discarded"
+              << std::setw(11) << "truncated" << std::endl;
+    for (ReplayResult const& result : results) {
+      Parameters const& parameters = result.parameters;
+      NamedClassifier const& classifier = kClassifiers[parameters.classifier];
+      std::cout << std::left << std::setw(12) << classifier.name << std::right << std::setw(11);
+      if (!classifier.thresholded) {
+        std::cout << "-";
+      } else if (parameters.threshold == kLiveThreshold) {
+        std::cout << "live";
+      } else {
+        std::cout << parameters.threshold;
+      }
+      std::cout
+                << std::setw(8) << parameters.margin
+                << std::setw(13) << parameters.max_samples
+                << std::setw(9) << parameters.retries
+                << std::setw(11) << std::fixed << std::setprecision(4) << result.accuracy()
+                << std::setw(16) << std::scientific << std::setprecision(2)
+                << result.bit_error_rate()
+                << std::setw(13) << std::fixed << std::setprecision(2)
+                << result.rounds_per_byte()
+                << std::setw(12) << std::setprecision(3) << result.bits_per_round()
+                << std::setw(11) << result.discarded
+                << std::setw(11) << result.truncated << std::endl;
+    }
+  } catch (std::exception const& error) {
+    std::cerr << "meltdown_replay: " << error.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,239 @@
+//=============================================================================
+// Serialized cycle timers for the receiving end of the covert channel.
+//=============================================================================
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+enum class TimerKind {
+  kRdtsc,     // lfence; rdtsc; lfence
+  kRdtscp,    // rdtscp; lfence, waits for preceding loads by itself
+  kCounter    // a counter incremented by a thread on a sibling core
+};
+
+// Cost of an empty measurement is subtracted from every sample, so a sample
+// is the latency of the measured access alone. Counter timers measure in
+// counter ticks rather than TSC cycles.
+struct Timer {
+  TimerKind kind = TimerKind::kRdtsc;
+  uint64_t overhead = 0;
+  std::atomic<uint64_t> const* counter = nullptr;
+  double ticks_per_cycle = 1;
+};
+
+// CPUID.80000001H:EDX[27], not defined by every cpuid.h
+const unsigned int kRdtscpBit = 1u << 27;
+
+inline
+bool
+cpu_has_rdtscp() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & kRdtscpBit);
+}
+
+inline
+char const*
+timer_name(TimerKind kind) {
+  switch (kind) {
+    case TimerKind::kRdtsc:   return "rdtsc";
+    case TimerKind::kRdtscp:  return "rdtscp";
+    case TimerKind::kCounter: return "counter";
+  }
+  return "unknown";
+}
+
+inline
+bool
+parse_timer(char const* name, TimerKind & kind) {
+  for (TimerKind candidate : {TimerKind::kRdtsc, TimerKind::kRdtscp, TimerKind::kCounter}) {
+    if (strcmp(name, timer_name(candidate)) == 0) {
+      kind = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the timer before the measured access. All earlier memory accesses
+// have to retire first.
+inline
+uint64_t
+timer_start(Timer const& timer) {
+  _mm_mfence();
+  _mm_lfence();
+  uint64_t now = timer.kind == TimerKind::kCounter
+               ? timer.counter->load(std::memory_order_relaxed)
+               : __rdtsc();
+  _mm_lfence();
+  return now;
+}
+
+// Reads the timer after the measured access. rdtscp waits for the access to
+// complete, rdtsc and the counter need an lfence for that.
+inline
+uint64_t
+timer_stop(Timer const& timer) {
+  uint64_t now;
+  if (timer.kind == TimerKind::kRdtscp) {
+    unsigned int aux;
+    now = __rdtscp(&aux);
+  } else if (timer.kind == TimerKind::kCounter) {
+    _mm_lfence();
+    now = timer.counter->load(std::memory_order_relaxed);
+  } else {
+    _mm_lfence();
+    now = __rdtsc();
+  }
+  _mm_lfence();
+  return now;
+}
+
+// The elapsed time in 64 bit, minus the overhead and saturated to 32 bit.
+inline
+uint32_t
+timer_elapsed(Timer const& timer, uint64_t start, uint64_t stop) {
+  uint64_t elapsed = stop - start;
+  elapsed = elapsed > timer.overhead ? elapsed - timer.overhead : 0;
+  return (uint32_t)std::min<uint64_t>(elapsed, UINT32_MAX);
+}
+
+// The overhead is the fastest empty measurement: subtracting anything larger
+// would clip real hits to zero.
+const size_t kTimerCalibrationRuns = 10000;
+
+inline
+void
+calibrate_timer(Timer & timer) {
+  uint64_t fastest = UINT64_MAX;
+  for (size_t i = 0; i < kTimerCalibrationRuns; ++i) {
+    uint64_t start = timer_start(timer);
+    uint64_t stop = timer_stop(timer);
+    fastest = std::min(fastest, stop - start);
+  }
+  timer.overhead = fastest;
+}
+
+// Picks the CPU for the counting thread: a hyper-thread sibling of cpu if
+// there is one, otherwise any other CPU we may run on. Returns -1 if cpu is
+// the only one.
+inline
+int
+counting_cpu(int cpu) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return -1;
+  }
+
+  // thread_siblings_list looks like "0,4" or "0-1"
+  std::ifstream siblings("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                         "/topology/thread_siblings_list");
+  std::string list;
+  if (std::getline(siblings, list)) {
+    for (char * token = strtok(&list[0], ",-"); token; token = strtok(nullptr, ",-")) {
+      int sibling = atoi(token);
+      if (sibling != cpu && CPU_ISSET(sibling, &allowed)) {
+        return sibling;
+      }
+    }
+  }
+  for (int other = 0; other < CPU_SETSIZE; ++other) {
+    if (other != cpu && CPU_ISSET(other, &allowed)) {
+      return other;
+    }
+  }
+  return -1;
+}
+
+inline
+void
+pin_thread(pthread_t thread, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (error) {
+    throw std::system_error(error, std::generic_category(), "pthread_setaffinity_np");
+  }
+}
+
+// A timer for hosts that trap or coarsen rdtsc: a thread pinned next to the
+// calling thread does nothing but increment a shared counter. The calling
+// thread is pinned to its current CPU so the two never share a core's time.
+class CountingThread {
+public:
+  CountingThread()
+    : cpu_(sched_getcpu())
+    , counting_cpu_(counting_cpu(cpu_))
+  {
+    if (counting_cpu_ < 0) {
+      throw std::system_error(EAGAIN, std::generic_category(),
+                              "counting thread needs a second CPU");
+    }
+    pin_thread(pthread_self(), cpu_);
+    thread_ = std::thread([this] {
+      uint64_t count = 0;
+      while (!stop_.load(std::memory_order_relaxed)) {
+        counter_.store(++count, std::memory_order_relaxed);
+      }
+    });
+    pin_thread(thread_.native_handle(), counting_cpu_);
+  }
+
+  ~CountingThread() {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+  }
+
+  CountingThread(CountingThread const&) = delete;
+  CountingThread& operator=(CountingThread const&) = delete;
+
+  std::atomic<uint64_t> const* counter() const { return &counter_; }
+
+private:
+  int cpu_;
+  int counting_cpu_;
+  // keep the hot counter and the stop flag on different cache lines
+  std::atomic<uint64_t> counter_{0};
+  char padding_[64];
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+// The counter must tick at least once every 32 TSC cycles, otherwise the
+// difference between a cache hit and a miss is lost in its resolution.
+const uint64_t kCounterCalibrationCycles = 10000000;
+const double kMinTicksPerCycle = 1.0 / 32;
+
+// Measures the counter rate against the TSC. Returns false if the counter is
+// too coarse to be of any use.
+inline
+bool
+calibrate_counter(Timer & timer, CountingThread const& thread) {
+  timer.kind = TimerKind::kCounter;
+  timer.counter = thread.counter();
+  uint64_t start = __rdtsc();
+  uint64_t ticks = timer.counter->load(std::memory_order_relaxed);
+  uint64_t now;
+  while ((now = __rdtsc()) - start < kCounterCalibrationCycles) {
+    _mm_pause();
+  }
+  ticks = timer.counter->load(std::memory_order_relaxed) - ticks;
+  timer.ticks_per_cycle = double(ticks) / (now - start);
+  return timer.ticks_per_cycle >= kMinTicksPerCycle;
+}
+
+#endif // TIMER_H
@@ -0,0 +1,346 @@
+//=============================================================================
+// Raw traces of probe rounds. Every round of sample_byte can be appended to a
+// file: the 256 access times, the outcome of the transient load, how long the
+// round took, the thresholds it was classified with and whether the round
+// filter found it poisoned and, in the self-test, the byte that should have
+// been recovered. The file is a ring of
+// fixed size records behind a header. The ring is kept in anonymous memory so
+// that recording costs a memcpy and no system call, and is written to the file
+// when the recorder is destroyed or the process is interrupted.
+//=============================================================================
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char kTraceMagic[8] = {'M', 'E', 'L', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t kTraceVersion = 4;
+
+// rounds kept in a trace unless asked otherwise, some 4.6 MB: the ring and the
+// probe region fit the usual 8 MB RLIMIT_MEMLOCK
+const uint64_t kDefaultTraceRounds = 8192;
+
+// recorders a signal can write out at once, one per CPU
+const size_t kMaxLiveRecorders = 1024;
+
+// the expected byte of a round outside the self-test
+const uint16_t kUnknownByte = 0x100;
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;          // records in the ring
+  uint64_t head;              // records ever written, the next goes to head % capacity
+  uint32_t threshold;         // calibrated hit/miss threshold
+  uint32_t timer_overhead;
+  uint32_t hit_median;
+  uint32_t miss_median;
+  uint32_t slow;              // bounds of the round filter at calibration
+  uint32_t min_margin;
+  uint32_t reference_interval; // rounds between reference probes, 0 if fixed
+  uint8_t stride_exp;         // layout of the channel
+  uint8_t symbol_bits;
+  uint8_t reserved[2];
+};
+
+// outcome is kTransientCompleted, kTransientFaulted or a TSX abort status.
+// poison is the Poison verdict the round filter gave while recording, with
+// the threshold, slow bound and margin of the record, which follow the drift
+// of the host. Access times are saturated to 16 bit; slots the layout does not
+// use read UINT16_MAX.
+struct TraceRecord {
+  uint64_t byte_index;        // bytes sampled before this one
+  uint64_t tsc;               // when the round started
+  uint32_t round;             // round within the symbol
+  uint32_t outcome;
+  uint32_t cycles;            // the leak and the probes, saturated to 32 bit
+  uint32_t threshold;         // live hit/miss threshold
+  uint32_t slow;              // live bounds of the round filter
+  uint32_t min_margin;
+  uint16_t expected;          // the canary byte or kUnknownByte
+  uint8_t symbol;             // symbol within the byte
+  uint8_t poison;
+  uint8_t reserved[4];
+  uint16_t access_times[256];
+};
+
+static_assert(sizeof(TraceHeader) == 64, "trace header layout");
+static_assert(sizeof(TraceRecord) == 560, "trace record layout");
+
+// Creates a trace file and records into a ring in memory, which the
+// destructor writes to the file, the records written and no more. SIGINT and
+// SIGTERM write every live recorder out before the process dies, as does a
+// fatal SIGSEGV caught by the signal backend; a run killed otherwise leaves
+// the file as it was. The ring is written up front and locked if
+// RLIMIT_MEMLOCK allows, so appending does not fault. Unlocked, the kernel
+// may swap the ring out under pressure, and locked() tells which.
+class TraceRecorder {
+public:
+  TraceRecorder(std::string const& path, uint64_t capacity)
+    : path_(path)
+    , capacity_(std::max<uint64_t>(capacity, 1))
+    , size_(sizeof(TraceHeader) + capacity_ * sizeof(TraceRecord))
+    , expected_(kUnknownByte)
+  {
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    void * mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      int error = errno;
+      close(fd_);
+      throw std::system_error(error, std::generic_category(), "mmap");
+    }
+    header_ = static_cast<TraceHeader*>(mapping);
+    records_ = reinterpret_cast<TraceRecord*>(header_ + 1);
+    memset(mapping, 0, size_);
+    locked_ = mlock(mapping, size_) == 0;
+
+    memcpy(header_->magic, kTraceMagic, sizeof(kTraceMagic));
+    header_->version = kTraceVersion;
+    header_->record_size = sizeof(TraceRecord);
+    header_->capacity = capacity_;
+
+    static bool const installed = install_handlers();
+    (void)installed;
+    for (std::atomic<TraceRecorder*> & slot : live()) {
+      TraceRecorder * expected = nullptr;
+      if (slot.compare_exchange_strong(expected, this)) {
+        break;
+      }
+    }
+  }
+
+  ~TraceRecorder() {
+    for (std::atomic<TraceRecorder*> & slot : live()) {
+      TraceRecorder * expected = this;
+      slot.compare_exchange_strong(expected, nullptr);
+    }
+    if (int error = write_file()) {
+      fprintf(stderr, "cannot write %s: %s\n", path_.c_str(), strerror(error));
+    }
+    close(fd_);
+    munmap(header_, size_);
+  }
+
+  TraceRecorder(TraceRecorder const&) = delete;
+  TraceRecorder& operator=(TraceRecorder const&) = delete;
+
+  void
+  set_calibration(uint32_t threshold, uint32_t timer_overhead, uint32_t hit_median,
+                  uint32_t miss_median) {
+    header_->threshold = threshold;
+    header_->timer_overhead = timer_overhead;
+    header_->hit_median = hit_median;
+    header_->miss_median = miss_median;
+  }
+
+  void
+  set_filter(uint32_t slow, uint32_t min_margin) {
+    header_->slow = slow;
+    header_->min_margin = min_margin;
+  }
+
+  void set_reference_interval(uint32_t interval) { header_->reference_interval = interval; }
+
+  void
+  set_layout(size_t stride_exp, size_t symbol_bits) {
+    header_->stride_exp = (uint8_t)stride_exp;
+    header_->symbol_bits = (uint8_t)symbol_bits;
+  }
+
+  // the byte the following rounds should recover, or kUnknownByte
+  void expect(uint16_t expected) { expected_ = expected; }
+
+  // the thresholds the following rounds are classified with
+  void
+  set_thresholds(uint32_t threshold, uint32_t slow, uint32_t min_margin) {
+    threshold_ = threshold;
+    slow_ = slow;
+    min_margin_ = min_margin;
+  }
+
+  template <typename AccessTimes>
+  void
+  append(uint64_t byte_index, size_t symbol, uint32_t round, uint64_t tsc,
+         uint32_t outcome, uint64_t cycles, uint8_t poison, AccessTimes const& access_times,
+         size_t slots) {
+    TraceRecord & record = records_[header_->head % capacity_];
+    record.byte_index = byte_index;
+    record.tsc = tsc;
+    record.round = round;
+    record.outcome = outcome;
+    record.cycles = (uint32_t)std::min<uint64_t>(cycles, UINT32_MAX);
+    record.poison = poison;
+    record.threshold = threshold_;
+    record.slow = slow_;
+    record.min_margin = min_margin_;
+    record.expected = expected_;
+    record.symbol = (uint8_t)symbol;
+    for (size_t j = 0; j < slots; ++j) {
+      record.access_times[j] = (uint16_t)std::min<uint32_t>(access_times[j], UINT16_MAX);
+    }
+    std::fill(record.access_times + slots, record.access_times + 256, UINT16_MAX);
+    header_->head++;
+  }
+
+  uint64_t records() const { return std::min(header_->head, capacity_); }
+  // false if RLIMIT_MEMLOCK refused to lock the ring
+  bool locked() const { return locked_; }
+
+  // Writes every live recorder to its file. Safe in a signal handler: it
+  // takes no locks and makes async-signal-safe calls only.
+  static
+  void
+  write_live() {
+    for (std::atomic<TraceRecorder*> & slot : live()) {
+      if (TraceRecorder * recorder = slot.load()) {
+        recorder->write_file();
+      }
+    }
+  }
+
+private:
+  static
+  std::array<std::atomic<TraceRecorder*>, kMaxLiveRecorders> &
+  live() {
+    static std::array<std::atomic<TraceRecorder*>, kMaxLiveRecorders> recorders{};
+    return recorders;
+  }
+
+  static
+  void
+  handle_signal(int signal) {
+    write_live();
+    ::signal(signal, SIG_DFL);
+    raise(signal);
+  }
+
+  static
+  bool
+  install_handlers() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGINT, &action, nullptr) == 0 &&
+           sigaction(SIGTERM, &action, nullptr) == 0;
+  }
+
+  // Writes the header and the records written, the ring up to its wrap, over
+  // whatever the file held. Returns 0 or the errno of the failure; a
+  // destructor cannot throw, so it is only reported.
+  int
+  write_file() {
+    size_t size = sizeof(TraceHeader) + records() * sizeof(TraceRecord);
+    if (ftruncate(fd_, size) != 0) {
+      return errno;
+    }
+    char const* data = reinterpret_cast<char const*>(header_);
+    size_t written = 0;
+    while (written < size) {
+      ssize_t n = pwrite(fd_, data + written, size - written, written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return n < 0 ? errno : EIO;
+      }
+      written += n;
+    }
+    return 0;
+  }
+
+  std::string path_;
+  int fd_;
+  uint64_t capacity_;
+  size_t size_;
+  bool locked_;
+  uint16_t expected_;
+  uint32_t threshold_ = 0;
+  uint32_t slow_ = 0;
+  uint32_t min_margin_ = 0;
+  TraceHeader * header_;
+  TraceRecord * records_;
+};
+
+// A trace opened for reading. Records are indexed in the order they were
+// written, oldest first, whatever their position in the ring.
+class TraceFile {
+public:
+  explicit TraceFile(std::string const& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+      int error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), "fstat " + path);
+    }
+    size_ = status.st_size;
+    if (size_ < sizeof(TraceHeader)) {
+      close(fd);
+      throw std::runtime_error(path + " is not a trace");
+    }
+    void * mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(error, std::generic_category(), "mmap " + path);
+    }
+    header_ = static_cast<TraceHeader const*>(mapping);
+    records_ = reinterpret_cast<TraceRecord const*>(header_ + 1);
+    if (memcmp(header_->magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+        header_->version != kTraceVersion || header_->record_size != sizeof(TraceRecord) ||
+        header_->capacity == 0 ||
+        size_ < sizeof(TraceHeader) + size() * sizeof(TraceRecord)) {
+      munmap(mapping, size_);
+      throw std::runtime_error(path + " is not a version " +
+                               std::to_string(kTraceVersion) + " trace");
+    }
+  }
+
+  ~TraceFile() {
+    munmap(const_cast<TraceHeader*>(header_), size_);
+  }
+
+  TraceFile(TraceFile const&) = delete;
+  TraceFile& operator=(TraceFile const&) = delete;
+
+  TraceHeader const& header() const { return *header_; }
+  uint64_t size() const { return std::min(header_->head, header_->capacity); }
+  // true if the ring wrapped and the oldest rounds were overwritten
+  bool wrapped() const { return header_->head > header_->capacity; }
+
+  TraceRecord const&
+  operator[](uint64_t i) const {
+    return records_[(header_->head - size() + i) % header_->capacity];
+  }
+
+private:
+  size_t size_;
+  TraceHeader const* header_;
+  TraceRecord const* records_;
+};
+
+#endif // TRACE_H